@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stack>
 #include <cmath>
+#include <algorithm>
 
 #include "RayTracer.h"
 #include "scene/light.h"
@@ -81,6 +82,10 @@ static get_sample_t super_sampling_method[RAYTRACING_SUPERSAMPLING_MAX] = {
 	RayTracing_SuperSampling_getSample_jittered
 };
 
+// packet
+// camera rays are traced in square tiles of this size, one packet per tile
+static const int packet_tile_size = 8;  // 8 x 8 = RAY_PACKET_SIZE
+
 // random seed
 // for testing purpose, everything should be controlable and the result must be expected 
 // ...
@@ -133,6 +138,13 @@ vec3f RayTracer::traceRay(RayData *data) {
 	isect i;
 	if (data->scene->intersect(*(data->r), i) == false) return vec3f();
 
+	return traceHit(data, i);
+}
+
+
+// shade the intersection i of the ray, and carry on with its reflection and
+// refraction
+vec3f RayTracer::traceHit(RayData *data, isect& i) {
 	// check if leaving or entering the object
 	// if leaving the object,
 	// then need to correct the normal (for unity)
@@ -384,6 +396,15 @@ RayTracer::RayTracer() {
 	scene = NULL;
 
 	m_bSceneLoaded = false;
+
+	m_bOverrideAccelerator = false;
+	m_acceleratorMethod = SCENE_ACCELERATOR_BVH;
+	m_bOverrideNodeFormat = false;
+	m_nodeFormat = SCENE_NODE_FLOAT;
+	m_bAcceleratorCache = false;
+	m_bMeshReordering = false;
+	m_lightSamples = 0;
+	m_lightCutoff = 0.0;
 }
 
 
@@ -410,6 +431,60 @@ bool RayTracer::sceneLoaded() {
 }
 
 
+double RayTracer::getBuildTime() {
+	return scene ? scene->getBuildTime() : 0;
+}
+
+
+void RayTracer::getOccluderCacheStats(unsigned long long& hits, unsigned long long& misses) {
+	hits = misses = 0;
+	if (!scene) return;
+
+	for (list<Light*>::const_iterator l = scene->beginLights(); l != scene->endLights(); ++l) {
+		hits	+= (*l)->getOccluderHits();
+		misses	+= (*l)->getOccluderMisses();
+	}
+}
+
+
+void RayTracer::getVertexStride(double& before, double& after) {
+	before = after = 0.0;
+	if (scene) scene->getVertexStride(before, after);
+}
+
+
+void RayTracer::setAcceleratorMethod(Scene_Accelerator_Method method) {
+	m_bOverrideAccelerator = true;
+	m_acceleratorMethod = method;
+}
+
+
+void RayTracer::setNodeFormat(Scene_Node_Format format) {
+	m_bOverrideNodeFormat = true;
+	m_nodeFormat = format;
+}
+
+
+void RayTracer::setAcceleratorCache(bool enable) {
+	m_bAcceleratorCache = enable;
+}
+
+
+void RayTracer::setMeshReordering(bool enable) {
+	m_bMeshReordering = enable;
+}
+
+
+void RayTracer::setLightSamples(int n) {
+	m_lightSamples = n;
+}
+
+
+void RayTracer::setLightCutoff(double cutoff) {
+	m_lightCutoff = cutoff;
+}
+
+
 bool RayTracer::loadScene( char* fn ) {
 	try
 	{
@@ -431,6 +506,16 @@ bool RayTracer::loadScene( char* fn ) {
 	buffer = new unsigned char[ bufferSize ];
 	
 	// separate objects into bounded and unbounded
+	// and build the acceleration structure
+	if (m_bOverrideAccelerator)
+		scene->setAcceleratorMethod(m_acceleratorMethod);
+	if (m_bOverrideNodeFormat)
+		scene->setNodeFormat(m_nodeFormat);
+	if (m_bAcceleratorCache)
+		scene->setCacheFile(string(fn) + ".accel");
+	scene->setMeshReordering(m_bMeshReordering);
+	scene->setLightSamples(m_lightSamples);
+	scene->setLightCutoff(m_lightCutoff);
 	scene->initScene();
 	
 	// Add any specialized scene loading code here
@@ -452,6 +537,10 @@ void RayTracer::traceSetup( int w, int h ) {
 		buffer = new unsigned char[ bufferSize ];
 	}
 	memset( buffer, 0, w*h*3 );
+
+	// the attenuation the lights' reach depends on may have changed
+	if( scene )
+		scene->buildLightGrid();
 }
 
 
@@ -461,6 +550,18 @@ void RayTracer::traceLines( int start, int stop ) {
 
 	if(stop > buffer_height) stop = buffer_height;
 
+	// trace tile
+	// with a single sample per pixel, neighbouring camera rays are traced
+	// together as packets
+	if (traceUI->getSuperSamplingMethod() == RAYTRACING_SUPERSAMPLING_NONE) {
+		for (int j = start; j < stop; j += packet_tile_size) {
+			for (int i = 0; i < buffer_width; i += packet_tile_size) {
+				traceTile(i, j, std::min(i + packet_tile_size, buffer_width), std::min(j + packet_tile_size, stop));
+			}
+		}
+		return;
+	}
+
 	// trace pixel
 	for (int j = start; j < stop; ++j) {
 		for (int i = 0; i < buffer_width; ++i) {
@@ -470,6 +571,58 @@ void RayTracer::traceLines( int start, int stop ) {
 }
 
 
+// Trace the pixels [x0, x1) x [y0, y1), one sample each, finding the first
+// hits of all their camera rays as one packet.  Only the objects within
+// the tile's frustum are tried.
+void RayTracer::traceTile(int x0, int y0, int x1, int y1) {
+	if (!scene) return;
+
+	// variable preparation
+	ray			rays[RAY_PACKET_SIZE];
+	isect		isects[RAY_PACKET_SIZE];
+	const ray*	packet_r[RAY_PACKET_SIZE];
+	isect*		packet_i[RAY_PACKET_SIZE];
+	int			count = 0;
+
+	for (int j = y0; j < y1; ++j) {
+		for (int i = x0; i < x1; ++i) {
+			scene->getCamera()->rayThrough(double(i) / double(buffer_width), double(j) / double(buffer_height), rays[count]);
+			packet_r[count] = &rays[count];
+			packet_i[count] = &isects[count];
+			count++;
+		}
+	}
+
+	// first hits
+	// the frustum reaches half a pixel past the outer rays, so that none
+	// of them lies on its edge
+	Frustum frustum;
+	scene->getCamera()->frustumThrough(
+		(double(x0) - 0.5) / double(buffer_width), (double(y0) - 0.5) / double(buffer_height),
+		(double(x1) - 0.5) / double(buffer_width), (double(y1) - 0.5) / double(buffer_height), frustum);
+	scene->intersectPacket(count, packet_r, packet_i, frustum);
+
+	// shading, ray by ray (as trace() does)
+	const int		depth	= traceUI->getDepth();
+	const double	thresh	= 1.0;
+
+	count = 0;
+	for (int j = y0; j < y1; ++j) {
+		for (int i = x0; i < x1; ++i) {
+			vec3f result = vec3f();
+
+			if (thresh > traceUI->getThreshold() && isects[count].obj != NULL) {
+				RayData data(scene, &rays[count], nullptr, vec3f(thresh, thresh, thresh), depth);
+				result = traceHit(&data, isects[count]).clamp();
+			}
+
+			setPixel(i, j, result);
+			count++;
+		}
+	}
+}
+
+
 void RayTracer::tracePixel(int i, int j) {
 	if (!scene) return;
 
@@ -526,10 +679,15 @@ void RayTracer::tracePixel(int i, int j) {
 	}
 
 	// fill the pixel
+	setPixel(i, j, result);
+}
+
+
+void RayTracer::setPixel(int i, int j, const vec3f& color) {
 	unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
-	pixel[0] = (int)( 255.0 * result[0]);
-	pixel[1] = (int)( 255.0 * result[1]);
-	pixel[2] = (int)( 255.0 * result[2]);
+	pixel[0] = (int)( 255.0 * color[0]);
+	pixel[1] = (int)( 255.0 * color[1]);
+	pixel[2] = (int)( 255.0 * color[2]);
 }
 
 
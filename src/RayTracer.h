@@ -48,16 +48,56 @@ public:
 	void traceSetup( int w, int h );
 	void traceLines( int start = 0, int stop = 10000000 );
 	void tracePixel( int i, int j );
+	void traceTile( int x0, int y0, int x1, int y1 );
 
 	bool loadScene( char* fn );
 
 	bool sceneLoaded();
 
+	// the loaded scene, e.g. to move its objects with
+	// TransformNode::setXform() and Scene::update() between frames
+	Scene *getScene() { return scene; }
+
+	// seconds spent building the acceleration structures of the scene
+	double getBuildTime();
+
+	// shadow rays of all the lights settled by the object that blocked the
+	// light's previous one, and those that needed a search of the scene
+	void getOccluderCacheStats(unsigned long long& hits, unsigned long long& misses);
+
+	// average bytes between consecutive vertex fetches of the meshes, before
+	// and after reordering them; both 0 without setMeshReordering()
+	void getVertexStride(double& before, double& after);
+
+	// use this acceleration structure instead of the one the scene file asks for
+	void setAcceleratorMethod(Scene_Accelerator_Method method);
+
+	// store the nodes of wide BVHs in this format instead of the scene file's
+	void setNodeFormat(Scene_Node_Format format);
+
+	// keep the built acceleration structures in a file next to the scene,
+	// named after it with ".accel" appended, and reuse them from there
+	void setAcceleratorCache(bool enable);
+
+	// sort the faces and vertices of the meshes for locality as they load
+	void setMeshReordering(bool enable);
+
+	// shade every point with n point lights picked from a light tree
+	// instead of with all of them; 0 for all of them
+	void setLightSamples(int n);
+
+	// leave out point lights wherever they give less than cutoff; 0 to
+	// shade with every light everywhere
+	void setLightCutoff(double cutoff);
+
 protected:
+	vec3f	traceHit(RayData* data, isect& i);
 	vec3f	traceLightSource(const RayData* data);
 	vec3f	traceReflection(const RayData *data);
 	vec3f	traceRefraction(const RayData *data);
 
+	void	setPixel(int i, int j, const vec3f& color);
+
 private:
 	unsigned char *buffer;
 	int buffer_width, buffer_height;
@@ -65,6 +105,18 @@ private:
 	Scene *scene;
 
 	bool m_bSceneLoaded;
+
+	bool						m_bOverrideAccelerator;
+	Scene_Accelerator_Method	m_acceleratorMethod;
+
+	bool						m_bOverrideNodeFormat;
+	Scene_Node_Format			m_nodeFormat;
+
+	bool						m_bAcceleratorCache;
+	bool						m_bMeshReordering;
+
+	int							m_lightSamples;
+	double						m_lightCutoff;
 };
 
 
@@ -5,57 +5,35 @@
 #include "Box.h"
 
 
-// TODO: need prettier
+// The slab test of BoundingBox::intersect() on the unit box: branch-free,
+// with the sign of each direction component choosing the near face.
 bool Box::intersectLocal( const ray& r, isect& i ) const {
-	// double tfar = std::numeric_limits<double>::max();
-	// double tnear = -std::numeric_limits<double>::max();
+	const vec3f p = r.getPosition();
+	const vec3f& inv = r.getInverseDirection();
+
 	double tfar = DBL_MAX;
 	double tnear = -DBL_MAX;
 	int tnear_axis = 0;
 
-	int index;
-	for (index = 0; index < 3; index++) {
-
-		// check if parallel to plane
-		if (r.getDirection()[index] == 0) {
-			if (r.getPosition()[index] < -0.5 || r.getPosition()[index] > 0.5) return false;
-			continue;
-		}
-
-		double t1 = (-0.5 - r.getPosition()[index]) / r.getDirection()[index];
-		double t2 = (0.5 - r.getPosition()[index]) / r.getDirection()[index];
-
-		if (t1 > t2) {
-			std::swap(t1, t2);
-		}
-		if (t1 > tnear) {
-			tnear = t1;
-			tnear_axis = index;
-		}
-		if (t2 < tfar) {
-			tfar = t2;
-		}
-		if (tnear > tfar || tfar <= RAY_EPSILON) return false;
+	for (int index = 0; index < 3; index++) {
+		const double face = r.getSign(index) ? 0.5 : -0.5;
+		const double t1 = (face - p[index]) * inv[index];
+		const double t2 = (-face - p[index]) * inv[index];
+
+		tnear_axis = t1 > tnear ? index : tnear_axis;
+		tnear = t1 > tnear ? t1 : tnear;
+		tfar = t2 < tfar ? t2 : tfar;
 	}
 
+	if (tnear > tfar || tfar <= RAY_EPSILON) return false;
+
 	i.obj = this;
 	i.t = tnear;
 
 	// direction of normal is reverse of the direction of ray
-	switch (tnear_axis) {
-	default:
-	case 0:
-		i.N = vec3f(((r.getDirection()[0] < 0.0) ? 1.0 : -1.0), 0.0, 0.0);
-		break;
-
-	case 1:
-		i.N = vec3f(0.0, ((r.getDirection()[1] < 0.0) ? 1.0 : -1.0), 0.0);
-		break;
-
-	case 2:
-		i.N = vec3f(0.0, 0.0, ((r.getDirection()[2] < 0.0) ? 1.0 : -1.0));
-		break;
-	}
+	vec3f n(0.0, 0.0, 0.0);
+	n[tnear_axis] = r.getSign(tnear_axis) ? 1.0 : -1.0;
+	i.N = n;
 	
 	return true;
 }
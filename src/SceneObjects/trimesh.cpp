@@ -1,6 +1,60 @@
 #include <cmath>
-#include <float.h>
+#include <cstdlib>
+#include <algorithm>
 #include "trimesh.h"
+#include "../scene/acceleratorcache.h"
+
+#if defined(WIDEBVH_AVX)
+#include <immintrin.h>
+#elif defined(WIDEBVH_SSE)
+#include <emmintrin.h>
+#endif
+
+
+// Data Structure
+// The shadow queries of the faces for a TrimeshInstance, whose material
+// may let through another kt than the mesh's: the leaves of the face
+// hierarchy are tested with that kt instead.
+class Trimesh::ShadowVisitor : public AcceleratorVisitor {
+public:
+    const Trimesh&  mesh;
+    const vec3f&    kt;
+    vec3f           *atten;         // NULL to only look for a blocker
+    bool            blocked;
+
+    ShadowVisitor( const Trimesh& mesh, const vec3f& kt, vec3f *atten )
+        : mesh( mesh ), kt( kt ), atten( atten ), blocked( false ) {}
+
+    // the face hierarchy holds no objects
+    virtual bool visit( Geometry * /*obj*/, const ray& /*r*/, double& /*tMax*/ ) { return true; }
+
+    virtual bool visitPrimitives( const PrimitiveIntersector& /*owner*/, int first, int count, const ray& r, double& tMax )
+    {
+        if( atten == NULL )
+        {
+            blocked = mesh.occludedFaces( first, count, r, tMax, kt );
+            return !blocked;
+        }
+
+        mesh.attenuateFaces( first, count, r, tMax, kt, *atten );
+        return !atten->iszero();
+    }
+};
+
+
+// Static Function Prototype
+// the bits of x, up to 10, spread out to every third bit
+static uint32_t Trimesh_spreadBits( uint32_t x );
+
+// Total bytes between consecutive vertex fetches, for the faces' corners
+// taken in order.
+static double Trimesh_fetchDistance( const vector<int>& indices );
+
+// Geometry::intersect() for every ray of the packet, through the face
+// hierarchy of mesh: the rays are taken into its space by transform, and
+// the hits found there are brought back out as hits of obj.
+static void Trimesh_intersectPacket( const Trimesh& mesh, const SceneObject *obj, const LocalTransform& transform,
+                                     int count, const ray* const* r, isect* const* i );
 
 Trimesh::~Trimesh()
 {
@@ -26,6 +80,12 @@ void Trimesh::addNormal( const vec3f &n )
     normals.push_back( n );
 }
 
+void Trimesh::reserve( size_t num_vertices, size_t num_faces )
+{
+    vertices.reserve( vertices.size() + num_vertices );
+    indices.reserve( indices.size() + 3 * num_faces );
+}
+
 // Returns false if the vertices a,b,c don't all exist
 bool Trimesh::addFace( int a, int b, int c )
 {
@@ -34,10 +94,9 @@ bool Trimesh::addFace( int a, int b, int c )
     if( a >= vcnt || b >= vcnt || c >= vcnt )
         return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
-    newFace->setTransform(this->transform);
-    faces.push_back( newFace );
-    scene->add(newFace);
+    indices.push_back( a );
+    indices.push_back( b );
+    indices.push_back( c );
     return true;
 }
 
@@ -54,94 +113,618 @@ Trimesh::doubleCheck()
     return 0;
 }
 
-// Intersect ray r with the triangle abc.  If it hits returns true,
-// and put the parameter in t and the barycentric coordinates of the
-// intersection in bary.
-// Uses the algorithm and notation from _Graphic Gems 5_, p. 232.
-//
-// Calculates and returns the normal of the triangle too.
-bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
+BoundingBox Trimesh::faceBounds( int f ) const
 {
-    const vec3f& a = parent->vertices[ids[0]];
-    const vec3f& b = parent->vertices[ids[1]];
-    const vec3f& c = parent->vertices[ids[2]];
-    
+    const vec3f& a = vertices[indices[3*f]];
+    const vec3f& b = vertices[indices[3*f+1]];
+    const vec3f& c = vertices[indices[3*f+2]];
+
+    BoundingBox localbounds;
+    localbounds.max = maximum( maximum( a, b ), c );
+    localbounds.min = minimum( minimum( a, b ), c );
+    return localbounds;
+}
+
+void Trimesh::buildAccelerator()
+{
+    const bool reorder = scene->getMeshReordering();
+    const double fetch_before = reorder ? Trimesh_fetchDistance( indices ) : 0.0;
+    if( reorder )
+        sortFaces();
+
+    const int count = numFaces();
+    vector<BoundingBox> bounds( count );
+    for( int f = 0; f < count; ++f )
+        bounds[f] = faceBounds( f );
+
+    faceBVH.setNodeFormat( scene->getNodeFormat() );
+    faceBVH.setPrimitiveIntersector( this );
+    faceBVH.setLeafWidth( PACK_WIDTH );
+
+    // a tree from the cache must order exactly these faces, or it is rebuilt
+    AcceleratorCache *cache = scene->getAcceleratorCache();
+    if( cache == NULL || !cache->load( faceBVH, bounds ) ||
+        (int)faceBVH.getPrimitiveOrder().size() != count )
+    {
+        faceBVH.buildPrimitives( bounds );
+        if( cache != NULL )
+            cache->store( faceBVH, bounds );
+    }
+
+    // put the faces in the order the leaves refer to them by
+    const vector<int>& order = faceBVH.getPrimitiveOrder();
+    if( (int)order.size() == count )
+    {
+        Indices sorted( indices.size() );
+        for( int f = 0; f < count; ++f )
+        {
+            for( int j = 0; j < 3; ++j )
+                sorted[3*f+j] = indices[3*order[f]+j];
+        }
+        indices.swap( sorted );
+    }
+
+    if( reorder && !indices.empty() )
+    {
+        renumberVertices();
+        scene->addVertexStride( fetch_before, Trimesh_fetchDistance( indices ), indices.size() - 1 );
+    }
+
+    buildPacks();
+}
+
+void Trimesh::sortFaces()
+{
+    const int count = numFaces();
+    if( count == 0 )
+        return;
+
+    // 10 bits per axis
+    const BoundingBox box = ComputeLocalBoundingBox();
+    vec3f scale;
+    for( int axis = 0; axis < 3; ++axis )
+    {
+        const double extent = box.max[axis] - box.min[axis];
+        scale[axis] = extent > 0.0 ? 1023.0 / extent : 0.0;
+    }
+
+    vector< pair<uint32_t, int> > keys( count );
+    for( int f = 0; f < count; ++f )
+    {
+        const vec3f centroid = (vertices[indices[3*f]] + vertices[indices[3*f+1]] + vertices[indices[3*f+2]]) / 3.0;
+
+        uint32_t code = 0;
+        for( int axis = 0; axis < 3; ++axis )
+        {
+            const double q = (centroid[axis] - box.min[axis]) * scale[axis];
+            code |= Trimesh_spreadBits( (uint32_t)max( 0.0, min( q, 1023.0 ) ) ) << axis;
+        }
+        keys[f] = make_pair( code, f );
+    }
+    sort( keys.begin(), keys.end() );
+
+    Indices sorted( indices.size() );
+    for( int f = 0; f < count; ++f )
+    {
+        for( int j = 0; j < 3; ++j )
+            sorted[3*f+j] = indices[3*keys[f].second+j];
+    }
+    indices.swap( sorted );
+}
+
+// Vertices no face uses keep their order after all the others.
+void Trimesh::renumberVertices()
+{
+    const int num_vertices = (int)vertices.size();
+    vector<int> renumber( num_vertices, -1 );
+    vector<int> order;
+    order.reserve( num_vertices );
+
+    for( Indices::iterator ii = indices.begin(); ii != indices.end(); ++ii )
+    {
+        if( renumber[*ii] < 0 )
+        {
+            renumber[*ii] = (int)order.size();
+            order.push_back( *ii );
+        }
+        *ii = renumber[*ii];
+    }
+    for( int v = 0; v < num_vertices; ++v )
+    {
+        if( renumber[v] < 0 )
+            order.push_back( v );
+    }
+
+    Vertices sorted_vertices( num_vertices );
+    for( int v = 0; v < num_vertices; ++v )
+        sorted_vertices[v] = vertices[order[v]];
+    vertices.swap( sorted_vertices );
+
+    if( !normals.empty() )
+    {
+        Normals sorted_normals( num_vertices );
+        for( int v = 0; v < num_vertices; ++v )
+            sorted_normals[v] = normals[order[v]];
+        normals.swap( sorted_normals );
+    }
+
+    if( !materials.empty() )
+    {
+        Materials sorted_materials( num_vertices );
+        for( int v = 0; v < num_vertices; ++v )
+            sorted_materials[v] = materials[order[v]];
+        materials.swap( sorted_materials );
+    }
+}
+
+void Trimesh::buildPacks()
+{
+    vector< pair<int, int> > leaves;
+    faceBVH.getLeaves( leaves );
+
+    size_t count = 0;
+    for( size_t l = 0; l < leaves.size(); ++l )
+        count += (leaves[l].second + PACK_WIDTH - 1) / PACK_WIDTH;
+
+    packs.clear();
+    packs.reserve( count );
+    leaf_pack.assign( numFaces(), -1 );
+
+    for( size_t l = 0; l < leaves.size(); ++l )
+    {
+        const int first = leaves[l].first;
+        const int end = first + leaves[l].second;
+        leaf_pack[first] = (int)packs.size();
+
+        for( int f0 = first; f0 < end; f0 += PACK_WIDTH )
+        {
+            TrianglePack pack;
+            for( int k = 0; k < PACK_WIDTH; ++k )
+            {
+                const int f = f0 + k;
+                vec3f a, b, c, n;
+                if( f < end )
+                {
+                    a = vertices[indices[3*f]];
+                    b = vertices[indices[3*f+1]];
+                    c = vertices[indices[3*f+2]];
+
+                    // there exists some bad triangles such that two vertices coincide
+                    // check this before normalize
+                    const vec3f cv = (b - a).cross( c - a );
+                    if( !cv.iszero() )
+                        n = cv.normalize();
+                }
+
+                pack.face[k] = f < end ? f : -1;
+                for( int axis = 0; axis < 3; ++axis )
+                {
+                    pack.a[axis][k] = a[axis];
+                    pack.b[axis][k] = b[axis];
+                    pack.c[axis][k] = c[axis];
+                    pack.n[axis][k] = n[axis];
+                }
+            }
+            packs.push_back( pack );
+        }
+    }
+}
+
+// The ray is already in the mesh's local space, which is also the space
+// the face hierarchy was built in.
+bool Trimesh::intersectLocal( const ray& r, isect& i ) const
+{
+    return faceBVH.intersectLocal( r, i );
+}
+
+void Trimesh::intersectPacket( int count, const ray* const* r, isect* const* i ) const
+{
+    Trimesh_intersectPacket( *this, this, local_transform, count, r, i );
+}
+
+void Trimesh::intersectPacketLocal( int count, const ray* const* r, isect* const* i ) const
+{
+    faceBVH.intersectPacketLocal( count, r, i );
+}
+
+bool Trimesh::occludedLocal( const ray& r, double tMax ) const
+{
+    return faceBVH.occludedLocal( r, tMax );
+}
+
+// The mesh does not know the caller's threshold, so its faces are only
+// skipped once nothing at all gets through.
+void Trimesh::attenuateLocal( const ray& r, double tMax, vec3f& atten ) const
+{
+    faceBVH.attenuateLocal( r, tMax, 0.0, atten );
+}
+
+bool Trimesh::occludedLocal( const ray& r, double tMax, const vec3f& kt ) const
+{
+    ShadowVisitor visitor( *this, kt, NULL );
+    faceBVH.traverse( r, tMax, visitor );
+    return visitor.blocked;
+}
+
+void Trimesh::attenuateLocal( const ray& r, double tMax, const vec3f& kt, vec3f& atten ) const
+{
+    ShadowVisitor visitor( *this, kt, &atten );
+    faceBVH.traverse( r, tMax, visitor );
+}
+
+bool Trimesh::isTransmissive() const
+{
+    if( materials.empty() )
+        return MaterialSceneObject::isTransmissive();
+
+    for( Materials::const_iterator mi = materials.begin(); mi != materials.end(); ++mi )
+    {
+        if( !(*mi)->kt.iszero() )
+            return true;
+    }
+    return false;
+}
+
+// The packs of a leaf are tested one after the other, keeping the
+// nearest hit; only that one gets its normal and material interpolated.
+bool Trimesh::intersectPrimitives( int first, int count, const ray& r, double tMax, isect& i ) const
+{
+    RayShear shear;
+    setupShear( r, shear );
+
+    const int begin = leaf_pack[first];
+    const int end = begin + (count + PACK_WIDTH - 1) / PACK_WIDTH;
+
+    int nearest = -1;
+    int nearest_lane = 0;
     vec3f bary;
-    float t;
-    vec3f n;
-    
-    vec3f p = r.getPosition();
-    vec3f v = r.getDirection();
-    
-    vec3f ab = b - a;
-    vec3f ac = c - a;
-    vec3f ap = p - a;
-    
-	vec3f cv=ab.cross(ac);
-
-	// there exists some bad triangles such that two vertices coincide
-	// check this before normalize
-	if (cv.iszero()) return false;
-    n = (cv).normalize();
-	
-    double vdotn = v*n;
-    if( -vdotn < NORMAL_EPSILON )
-        return false;
-    
-    t = - (ap*n)/vdotn;
-    
-    if( t < RAY_EPSILON )
-        return false;
 
-    // find k where k is the index of the component
-    // of normal vector with greatest absolute value
-    float greatestMag = FLT_MIN;
-    int k = -1;
-    for( int j = 0; j < 3; ++j )
+    for( int p = begin; p < end; ++p )
     {
-        float val = n[j];
-        if( val < 0 )
-            val *= -1;
-        if( val > greatestMag )
+        double t[PACK_WIDTH];
+        double b[3][PACK_WIDTH];
+        int mask = intersectPack( packs[p], shear, t, b );
+
+        for( int k = 0; mask != 0; ++k, mask >>= 1 )
         {
-            k = j;
-            greatestMag = val;
+            if( !(mask & 1) || t[k] >= tMax )
+                continue;
+
+            tMax = t[k];
+            nearest = p;
+            nearest_lane = k;
+            bary = vec3f( b[0][k], b[1][k], b[2][k] );
         }
     }
 
-    vec3f am = ap + t * v;
-    
-	bary[1] = (am.cross(ac))[k]/(ab.cross(ac))[k];
-    bary[2] = (ab.cross(am))[k]/(ab.cross(ac))[k];
-    bary[0] = 1-bary[1]-bary[2];
-    if( bary[0] < 0 || bary[1] < 0 || bary[1] > 1 || bary[2] < 0 || bary[2] > 1 )
+    if( nearest < 0 )
         return false;
 
     // if we get this far, we have an intersection.  Fill in the info.
-    i.setT( t );
-    if(parent->normals.size())
+    const TrianglePack& pack = packs[nearest];
+    const int *ids = &indices[3*pack.face[nearest_lane]];
+    i.setT( tMax );
+    if( normals.size() )
     {
         // use interpolated normals
-        i.setN( (bary[0] * parent->normals[ids[0]]
-                 + bary[1] * parent->normals[ids[1]]
-                 + bary[2] * parent->normals[ids[2]]).normalize() );
+        i.setN( (bary[0] * normals[ids[0]]
+                 + bary[1] * normals[ids[1]]
+                 + bary[2] * normals[ids[2]]).normalize() );
     } else {
-        i.setN( n );           // use face normal
+        // use face normal
+        i.setN( vec3f( pack.n[0][nearest_lane], pack.n[1][nearest_lane], pack.n[2][nearest_lane] ) );
     }
     i.obj = this;
 
     // linearly interpolate materials
-    if( parent->materials.size() )
+    if( materials.size() )
     {
         Material *m = new Material();
         for( int jj = 0; jj < 3; ++jj )
-            (*m) += bary[jj] * (*parent->materials[ ids[jj] ]);
+            (*m) += bary[jj] * (*materials[ ids[jj] ]);
         i.setMaterial( m );
     }
-    
+
     return true;
 }
 
+bool Trimesh::occludedPrimitives( int first, int count, const ray& r, double tMax ) const
+{
+    return occludedFaces( first, count, r, tMax, material->kt );
+}
+
+void Trimesh::attenuatePrimitives( int first, int count, const ray& r, double tMax, vec3f& atten ) const
+{
+    attenuateFaces( first, count, r, tMax, material->kt, atten );
+}
+
+bool Trimesh::occludedFaces( int first, int count, const ray& r, double tMax, const vec3f& kt ) const
+{
+    RayShear shear;
+    setupShear( r, shear );
+
+    const int begin = leaf_pack[first];
+    const int end = begin + (count + PACK_WIDTH - 1) / PACK_WIDTH;
+
+    for( int p = begin; p < end; ++p )
+    {
+        double t[PACK_WIDTH];
+        double b[3][PACK_WIDTH];
+        int mask = intersectPack( packs[p], shear, t, b );
+
+        for( int k = 0; mask != 0; ++k, mask >>= 1 )
+        {
+            if( (mask & 1) && t[k] < tMax &&
+                transmission( packs[p].face[k], vec3f( b[0][k], b[1][k], b[2][k] ), kt ).iszero() )
+                return true;
+        }
+    }
+    return false;
+}
+
+// A ray crosses a triangle at most once.
+void Trimesh::attenuateFaces( int first, int count, const ray& r, double tMax, const vec3f& kt, vec3f& atten ) const
+{
+    RayShear shear;
+    setupShear( r, shear );
+
+    const int begin = leaf_pack[first];
+    const int end = begin + (count + PACK_WIDTH - 1) / PACK_WIDTH;
+
+    for( int p = begin; p < end; ++p )
+    {
+        double t[PACK_WIDTH];
+        double b[3][PACK_WIDTH];
+        int mask = intersectPack( packs[p], shear, t, b );
+
+        for( int k = 0; mask != 0; ++k, mask >>= 1 )
+        {
+            if( (mask & 1) && t[k] < tMax )
+                atten = prod( atten, transmission( packs[p].face[k], vec3f( b[0][k], b[1][k], b[2][k] ), kt ) );
+        }
+    }
+}
+
+// The direction's longest axis becomes z; swapping the other two when it
+// points down z keeps the winding of the faces as it was.
+void Trimesh::setupShear( const ray& r, RayShear& shear )
+{
+    const vec3f& v = r.getDirection();
+
+    shear.kz = 0;
+    if( fabs( v[1] ) > fabs( v[shear.kz] ) ) shear.kz = 1;
+    if( fabs( v[2] ) > fabs( v[shear.kz] ) ) shear.kz = 2;
+    shear.kx = (shear.kz + 1) % 3;
+    shear.ky = (shear.kx + 1) % 3;
+    if( v[shear.kz] < 0.0 )
+        std::swap( shear.kx, shear.ky );
+
+    shear.org = r.getPosition();
+    shear.dir = v;
+    shear.sx = v[shear.kx] / v[shear.kz];
+    shear.sy = v[shear.ky] / v[shear.kz];
+    shear.sz = 1.0 / v[shear.kz];
+}
+
+// Intersect the ray with the faces of a pack.  Only the front of a face
+// is hit.
+//
+// The watertight test of Woop, Benthin and Wald (JCGT 2013): the corners
+// are moved into the sheared space of the ray, where the ray is the z axis,
+// and the signs of the three edge functions there tell whether it passes
+// inside.  Two faces that share an edge evaluate its function from the
+// same corners, exactly negated, so a ray through the edge always hits one
+// of them.  The lanes are computed in double precision, as PACK_WIDTH
+// doubles fill an AVX register, and two SSE2 ones.
+int Trimesh::intersectPack( const TrianglePack& pack, const RayShear& shear, double t[PACK_WIDTH], double bary[3][PACK_WIDTH] )
+{
+    const int kx = shear.kx;
+    const int ky = shear.ky;
+    const int kz = shear.kz;
+
+#if defined(WIDEBVH_AVX)
+    const __m256d zero = _mm256_setzero_pd();
+
+    // degenerate faces and empty lanes have no normal, and so never face
+    // the ray
+    const __m256d vdotn = _mm256_add_pd( _mm256_add_pd(
+        _mm256_mul_pd( _mm256_set1_pd( shear.dir[0] ), _mm256_loadu_pd( pack.n[0] ) ),
+        _mm256_mul_pd( _mm256_set1_pd( shear.dir[1] ), _mm256_loadu_pd( pack.n[1] ) ) ),
+        _mm256_mul_pd( _mm256_set1_pd( shear.dir[2] ), _mm256_loadu_pd( pack.n[2] ) ) );
+    __m256d ok = _mm256_cmp_pd( vdotn, _mm256_set1_pd( -NORMAL_EPSILON ), _CMP_LE_OQ );
+
+    const __m256d ox = _mm256_set1_pd( shear.org[kx] );
+    const __m256d oy = _mm256_set1_pd( shear.org[ky] );
+    const __m256d oz = _mm256_set1_pd( shear.org[kz] );
+    const __m256d sx = _mm256_set1_pd( shear.sx );
+    const __m256d sy = _mm256_set1_pd( shear.sy );
+    const __m256d sz = _mm256_set1_pd( shear.sz );
+
+    const __m256d az = _mm256_sub_pd( _mm256_loadu_pd( pack.a[kz] ), oz );
+    const __m256d bz = _mm256_sub_pd( _mm256_loadu_pd( pack.b[kz] ), oz );
+    const __m256d cz = _mm256_sub_pd( _mm256_loadu_pd( pack.c[kz] ), oz );
+    const __m256d ax = _mm256_sub_pd( _mm256_sub_pd( _mm256_loadu_pd( pack.a[kx] ), ox ), _mm256_mul_pd( sx, az ) );
+    const __m256d ay = _mm256_sub_pd( _mm256_sub_pd( _mm256_loadu_pd( pack.a[ky] ), oy ), _mm256_mul_pd( sy, az ) );
+    const __m256d bx = _mm256_sub_pd( _mm256_sub_pd( _mm256_loadu_pd( pack.b[kx] ), ox ), _mm256_mul_pd( sx, bz ) );
+    const __m256d by = _mm256_sub_pd( _mm256_sub_pd( _mm256_loadu_pd( pack.b[ky] ), oy ), _mm256_mul_pd( sy, bz ) );
+    const __m256d cx = _mm256_sub_pd( _mm256_sub_pd( _mm256_loadu_pd( pack.c[kx] ), ox ), _mm256_mul_pd( sx, cz ) );
+    const __m256d cy = _mm256_sub_pd( _mm256_sub_pd( _mm256_loadu_pd( pack.c[ky] ), oy ), _mm256_mul_pd( sy, cz ) );
+
+    const __m256d u = _mm256_sub_pd( _mm256_mul_pd( cx, by ), _mm256_mul_pd( cy, bx ) );
+    const __m256d v = _mm256_sub_pd( _mm256_mul_pd( ax, cy ), _mm256_mul_pd( ay, cx ) );
+    const __m256d w = _mm256_sub_pd( _mm256_mul_pd( bx, ay ), _mm256_mul_pd( by, ax ) );
+
+    // on an edge counts as inside
+    const __m256d all_ge = _mm256_and_pd( _mm256_and_pd(
+        _mm256_cmp_pd( u, zero, _CMP_GE_OQ ), _mm256_cmp_pd( v, zero, _CMP_GE_OQ ) ), _mm256_cmp_pd( w, zero, _CMP_GE_OQ ) );
+    const __m256d all_le = _mm256_and_pd( _mm256_and_pd(
+        _mm256_cmp_pd( u, zero, _CMP_LE_OQ ), _mm256_cmp_pd( v, zero, _CMP_LE_OQ ) ), _mm256_cmp_pd( w, zero, _CMP_LE_OQ ) );
+    ok = _mm256_and_pd( ok, _mm256_or_pd( all_ge, all_le ) );
+
+    const __m256d det = _mm256_add_pd( _mm256_add_pd( u, v ), w );
+    ok = _mm256_and_pd( ok, _mm256_cmp_pd( det, zero, _CMP_NEQ_OQ ) );
+    if( _mm256_movemask_pd( ok ) == 0 )
+        return 0;
+
+    const __m256d tz = _mm256_add_pd( _mm256_add_pd(
+        _mm256_mul_pd( _mm256_mul_pd( u, sz ), az ),
+        _mm256_mul_pd( _mm256_mul_pd( v, sz ), bz ) ),
+        _mm256_mul_pd( _mm256_mul_pd( w, sz ), cz ) );
+    const __m256d tt = _mm256_div_pd( tz, det );
+    ok = _mm256_and_pd( ok, _mm256_cmp_pd( tt, _mm256_set1_pd( RAY_EPSILON ), _CMP_GE_OQ ) );
+
+    _mm256_storeu_pd( t, tt );
+    _mm256_storeu_pd( bary[0], _mm256_div_pd( u, det ) );
+    _mm256_storeu_pd( bary[1], _mm256_div_pd( v, det ) );
+    _mm256_storeu_pd( bary[2], _mm256_div_pd( w, det ) );
+    return _mm256_movemask_pd( ok );
+#elif defined(WIDEBVH_SSE)
+    const __m128d zero = _mm_setzero_pd();
+    int mask = 0;
+
+    // two lanes at a time
+    for( int h = 0; h < PACK_WIDTH; h += 2 )
+    {
+        // degenerate faces and empty lanes have no normal, and so never
+        // face the ray
+        const __m128d vdotn = _mm_add_pd( _mm_add_pd(
+            _mm_mul_pd( _mm_set1_pd( shear.dir[0] ), _mm_loadu_pd( pack.n[0] + h ) ),
+            _mm_mul_pd( _mm_set1_pd( shear.dir[1] ), _mm_loadu_pd( pack.n[1] + h ) ) ),
+            _mm_mul_pd( _mm_set1_pd( shear.dir[2] ), _mm_loadu_pd( pack.n[2] + h ) ) );
+        __m128d ok = _mm_cmple_pd( vdotn, _mm_set1_pd( -NORMAL_EPSILON ) );
+
+        const __m128d ox = _mm_set1_pd( shear.org[kx] );
+        const __m128d oy = _mm_set1_pd( shear.org[ky] );
+        const __m128d oz = _mm_set1_pd( shear.org[kz] );
+        const __m128d sx = _mm_set1_pd( shear.sx );
+        const __m128d sy = _mm_set1_pd( shear.sy );
+        const __m128d sz = _mm_set1_pd( shear.sz );
+
+        const __m128d az = _mm_sub_pd( _mm_loadu_pd( pack.a[kz] + h ), oz );
+        const __m128d bz = _mm_sub_pd( _mm_loadu_pd( pack.b[kz] + h ), oz );
+        const __m128d cz = _mm_sub_pd( _mm_loadu_pd( pack.c[kz] + h ), oz );
+        const __m128d ax = _mm_sub_pd( _mm_sub_pd( _mm_loadu_pd( pack.a[kx] + h ), ox ), _mm_mul_pd( sx, az ) );
+        const __m128d ay = _mm_sub_pd( _mm_sub_pd( _mm_loadu_pd( pack.a[ky] + h ), oy ), _mm_mul_pd( sy, az ) );
+        const __m128d bx = _mm_sub_pd( _mm_sub_pd( _mm_loadu_pd( pack.b[kx] + h ), ox ), _mm_mul_pd( sx, bz ) );
+        const __m128d by = _mm_sub_pd( _mm_sub_pd( _mm_loadu_pd( pack.b[ky] + h ), oy ), _mm_mul_pd( sy, bz ) );
+        const __m128d cx = _mm_sub_pd( _mm_sub_pd( _mm_loadu_pd( pack.c[kx] + h ), ox ), _mm_mul_pd( sx, cz ) );
+        const __m128d cy = _mm_sub_pd( _mm_sub_pd( _mm_loadu_pd( pack.c[ky] + h ), oy ), _mm_mul_pd( sy, cz ) );
+
+        const __m128d u = _mm_sub_pd( _mm_mul_pd( cx, by ), _mm_mul_pd( cy, bx ) );
+        const __m128d v = _mm_sub_pd( _mm_mul_pd( ax, cy ), _mm_mul_pd( ay, cx ) );
+        const __m128d w = _mm_sub_pd( _mm_mul_pd( bx, ay ), _mm_mul_pd( by, ax ) );
+
+        // on an edge counts as inside
+        const __m128d all_ge = _mm_and_pd( _mm_and_pd( _mm_cmpge_pd( u, zero ), _mm_cmpge_pd( v, zero ) ), _mm_cmpge_pd( w, zero ) );
+        const __m128d all_le = _mm_and_pd( _mm_and_pd( _mm_cmple_pd( u, zero ), _mm_cmple_pd( v, zero ) ), _mm_cmple_pd( w, zero ) );
+        ok = _mm_and_pd( ok, _mm_or_pd( all_ge, all_le ) );
+
+        const __m128d det = _mm_add_pd( _mm_add_pd( u, v ), w );
+        ok = _mm_and_pd( ok, _mm_cmpneq_pd( det, zero ) );
+        if( _mm_movemask_pd( ok ) == 0 )
+            continue;
+
+        const __m128d tz = _mm_add_pd( _mm_add_pd(
+            _mm_mul_pd( _mm_mul_pd( u, sz ), az ),
+            _mm_mul_pd( _mm_mul_pd( v, sz ), bz ) ),
+            _mm_mul_pd( _mm_mul_pd( w, sz ), cz ) );
+        const __m128d tt = _mm_div_pd( tz, det );
+        ok = _mm_and_pd( ok, _mm_cmpge_pd( tt, _mm_set1_pd( RAY_EPSILON ) ) );
+
+        _mm_storeu_pd( t + h, tt );
+        _mm_storeu_pd( bary[0] + h, _mm_div_pd( u, det ) );
+        _mm_storeu_pd( bary[1] + h, _mm_div_pd( v, det ) );
+        _mm_storeu_pd( bary[2] + h, _mm_div_pd( w, det ) );
+        mask |= _mm_movemask_pd( ok ) << h;
+    }
+    return mask;
+#else
+    int mask = 0;
+    for( int k = 0; k < PACK_WIDTH; ++k )
+    {
+        // degenerate faces and empty lanes have no normal, and so never
+        // face the ray
+        double vdotn = shear.dir[0] * pack.n[0][k] + shear.dir[1] * pack.n[1][k] + shear.dir[2] * pack.n[2][k];
+        if( -vdotn < NORMAL_EPSILON )
+            continue;
+
+        const double az = pack.a[kz][k] - shear.org[kz];
+        const double bz = pack.b[kz][k] - shear.org[kz];
+        const double cz = pack.c[kz][k] - shear.org[kz];
+        const double ax = pack.a[kx][k] - shear.org[kx] - shear.sx * az;
+        const double ay = pack.a[ky][k] - shear.org[ky] - shear.sy * az;
+        const double bx = pack.b[kx][k] - shear.org[kx] - shear.sx * bz;
+        const double by = pack.b[ky][k] - shear.org[ky] - shear.sy * bz;
+        const double cx = pack.c[kx][k] - shear.org[kx] - shear.sx * cz;
+        const double cy = pack.c[ky][k] - shear.org[ky] - shear.sy * cz;
+
+        const double u = cx * by - cy * bx;
+        const double v = ax * cy - ay * cx;
+        const double w = bx * ay - by * ax;
+
+        // on an edge counts as inside
+        if( (u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0) )
+            continue;
+
+        const double det = u + v + w;
+        if( det == 0.0 )
+            continue;
+
+        t[k] = (u * shear.sz * az + v * shear.sz * bz + w * shear.sz * cz) / det;
+        if( t[k] < RAY_EPSILON )
+            continue;
+
+        bary[0][k] = u / det;
+        bary[1][k] = v / det;
+        bary[2][k] = w / det;
+        mask |= 1 << k;
+    }
+    return mask;
+#endif
+}
+
+// The shadow queries only need the transmissive part of the material, so
+// nothing else is interpolated.
+vec3f Trimesh::transmission( int f, const vec3f& bary, const vec3f& kt ) const
+{
+    if( materials.size() )
+    {
+        vec3f interpolated;
+        for( int jj = 0; jj < 3; ++jj )
+            interpolated += bary[jj] * materials[ indices[3*f+jj] ]->kt;
+        return interpolated;
+    }
+
+    return kt;
+}
+
+void Trimesh::bakeTransform( TransformNode *root )
+{
+    for( Vertices::iterator vi = vertices.begin(); vi != vertices.end(); ++vi )
+        *vi = transform->localToGlobalCoords( *vi );
+
+    // the normals are normalized after they are interpolated, so they are
+    // only taken through the matrix here
+    const mat3f& normi = transform->getNormalMatrix();
+    for( Normals::iterator ni = normals.begin(); ni != normals.end(); ++ni )
+        *ni = normi * (*ni);
+
+    // a mirroring transformation turns the faces over, and only their front
+    // sides are hit
+    const mat4f& inverse = transform->getInverse();
+    const vec3f x( inverse[0][0], inverse[1][0], inverse[2][0] );
+    const vec3f y( inverse[0][1], inverse[1][1], inverse[2][1] );
+    const vec3f z( inverse[0][2], inverse[1][2], inverse[2][2] );
+    const bool mirrored = x.cross( y ) * z < 0.0;
+
+    setTransform( root );
+    if( mirrored )
+    {
+        for( size_t f = 0; f < indices.size(); f += 3 )
+            std::swap( indices[f+1], indices[f+2] );
+    }
+}
+
 void
 Trimesh::generateNormals()
 // Once you've loaded all the verts and faces, we can generate per
@@ -152,18 +735,18 @@ Trimesh::generateNormals()
     int *numFaces = new int[ cnt ]; // the number of faces assoc. with each vertex
     memset( numFaces, 0, sizeof(int)*cnt );
     
-    for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
+    for( Indices::const_iterator fi = indices.begin(); fi != indices.end(); fi += 3 )
     {
-        vec3f a = vertices[(**fi)[0]];
-        vec3f b = vertices[(**fi)[1]];
-        vec3f c = vertices[(**fi)[2]];
+        vec3f a = vertices[fi[0]];
+        vec3f b = vertices[fi[1]];
+        vec3f c = vertices[fi[2]];
         
         vec3f faceNormal = ((b-a).cross(c-a)).normalize();
         
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
-            ++numFaces[(**fi)[i]];
+            normals[fi[i]] += faceNormal;
+            ++numFaces[fi[i]];
         }
     }
 
@@ -176,3 +759,93 @@ Trimesh::generateNormals()
     delete [] numFaces;
 }
 
+
+// TrimeshInstance
+
+bool TrimeshInstance::intersectLocal( const ray& r, isect& i ) const
+{
+    if( !mesh->intersectLocal( r, i ) )
+        return false;
+
+    i.obj = this;
+    return true;
+}
+
+void TrimeshInstance::intersectPacket( int count, const ray* const* r, isect* const* i ) const
+{
+    Trimesh_intersectPacket( *mesh, this, local_transform, count, r, i );
+}
+
+// Per-vertex materials replace the instance's own, as they do the mesh's.
+bool TrimeshInstance::occludedLocal( const ray& r, double tMax ) const
+{
+    return mesh->occludedLocal( r, tMax, material->kt );
+}
+
+void TrimeshInstance::attenuateLocal( const ray& r, double tMax, vec3f& atten ) const
+{
+    mesh->attenuateLocal( r, tMax, material->kt, atten );
+}
+
+bool TrimeshInstance::isTransmissive() const
+{
+    return mesh->hasMaterials() ? mesh->isTransmissive() : MaterialSceneObject::isTransmissive();
+}
+
+
+// Static Function Implementation
+static uint32_t Trimesh_spreadBits( uint32_t x )
+{
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x <<  8)) & 0x0300F00F;
+    x = (x | (x <<  4)) & 0x030C30C3;
+    x = (x | (x <<  2)) & 0x09249249;
+    return x;
+}
+
+// The corners of a face are fetched one after the other, so every index
+// counts, not only those of consecutive faces.
+static double Trimesh_fetchDistance( const vector<int>& indices )
+{
+    double total = 0.0;
+    for( size_t j = 1; j < indices.size(); ++j )
+        total += (double)abs( indices[j] - indices[j-1] ) * sizeof(vec3f);
+    return total;
+}
+
+static void Trimesh_intersectPacket( const Trimesh& mesh, const SceneObject *obj, const LocalTransform& transform,
+                                     int count, const ray* const* r, isect* const* i )
+{
+    ray local_rays[RAY_PACKET_SIZE];
+    isect local_isects[RAY_PACKET_SIZE];
+    double lengths[RAY_PACKET_SIZE];
+    const ray* local_r[RAY_PACKET_SIZE];
+    isect* local_i[RAY_PACKET_SIZE];
+
+    for( int k = 0; k < count; ++k )
+    {
+        lengths[k] = transform.toLocal( *r[k], local_rays[k] );
+        local_r[k] = &local_rays[k];
+        local_i[k] = &local_isects[k];
+
+        // the hit to beat, in local distances
+        local_isects[k].obj = i[k]->obj;
+        local_isects[k].t = i[k]->t * lengths[k];
+    }
+
+    mesh.intersectPacketLocal( count, local_r, local_i );
+
+    // a new hit is told by its distance: the faces are hit as the mesh
+    // itself, which the ray may have hit before, and are obj's
+    for( int k = 0; k < count; ++k )
+    {
+        if( local_isects[k].obj == NULL ||
+            (i[k]->obj != NULL && local_isects[k].t >= i[k]->t * lengths[k]) )
+            continue;
+
+        *i[k] = local_isects[k];
+        i[k]->obj = obj;
+        i[k]->N = transform.normalToGlobal( i[k]->N );
+        i[k]->t /= lengths[k];
+    }
+}
@@ -7,24 +7,93 @@
 #include "../scene/ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
-class TrimeshFace;
+#include "../scene/widebvh.h"
 
-class Trimesh : public MaterialSceneObject
+// A triangle mesh, stored as its vertices and three indices per face, with
+// one material for the whole mesh (or one per vertex).  The faces are no
+// objects of their own: the mesh is a single object of the scene, and
+// finds the faces a ray may hit through a hierarchy built over them in its
+// local space, whose leaves hand it ranges of faces.
+class Trimesh : public MaterialSceneObject, public PrimitiveIntersector
 {
-    friend class TrimeshFace;
     typedef vector<vec3f> Normals;
     typedef vector<vec3f> Vertices;
-    typedef vector<TrimeshFace*> Faces;
+    typedef vector<int> Indices;
     typedef vector<Material*> Materials;
     Vertices vertices;
-    Faces faces;
+    Indices indices;            // three per face
     Normals normals;
     Materials materials;
+
+    // the faces, organised in the mesh's local space; once built, the
+    // faces are kept in the order its leaves refer to them
+    WideBVH faceBVH;
+
+    // What the intersection test needs of PACK_WIDTH faces of one leaf,
+    // gathered once the faces are in their final order, one array per
+    // coordinate so that the faces are tested side by side: their corners,
+    // and their unit normals, zero for a degenerate face.  A leaf's last
+    // pack is filled up with empty lanes, which have no normal either.
+    static const int PACK_WIDTH = 4;
+
+    struct TrianglePack {
+        double  a[3][PACK_WIDTH];
+        double  b[3][PACK_WIDTH];
+        double  c[3][PACK_WIDTH];
+        double  n[3][PACK_WIDTH];
+        int     face[PACK_WIDTH];       // -1 for an empty lane
+    };
+    vector<TrianglePack> packs;
+    // for the first face of every leaf, the first of its packs
+    vector<int> leaf_pack;
+
+    // A ray as the watertight test sees it: the axis along which its
+    // direction is longest becomes z, and the shear that maps the
+    // direction onto z is applied to the corners of every face tested.
+    struct RayShear {
+        vec3f   org;
+        vec3f   dir;
+        int     kx, ky, kz;
+        double  sx, sy, sz;
+    };
+
+    static void setupShear( const ray& r, RayShear& shear );
+
+    int numFaces() const { return (int)(indices.size() / 3); }
+
+    BoundingBox faceBounds( int f ) const;
+
+    // fill in packs from the vertices and indices, leaf by leaf
+    void buildPacks();
+
+    // For Scene::setMeshReordering(): sort the faces by the Morton code of
+    // their centroids in the mesh's bounds, before the hierarchy is built,
+    // so that its input is already in space-filling order; and once the
+    // faces have their final order, number the vertices, with their
+    // normals and materials, in the order the faces first use them.
+    void sortFaces();
+    void renumberVertices();
+
+    // The ray-triangle test shared by the local queries, for the faces of
+    // a pack at once: returns the mask of the lanes hit, with the
+    // parameter and barycentric coordinates of each hit.
+    static int intersectPack( const TrianglePack& pack, const RayShear& shear, double t[PACK_WIDTH], double bary[3][PACK_WIDTH] );
+
+    // kt of face f at the point with barycentric coordinates bary, where
+    // kt is that of the mesh's material, for a mesh without per-vertex ones
+    vec3f transmission( int f, const vec3f& bary, const vec3f& kt ) const;
+
+    // the shadow queries of the faces in a leaf, with kt as above
+    bool occludedFaces( int first, int count, const ray& r, double tMax, const vec3f& kt ) const;
+    void attenuateFaces( int first, int count, const ray& r, double tMax, const vec3f& kt, vec3f& atten ) const;
+
+    // hands the leaves to the two above, for a material other than the mesh's
+    class ShadowVisitor;
 public:
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
         : MaterialSceneObject(scene, mat)
     {
-        this->transform = transform;
+        setTransform( transform );
     }
 
     ~Trimesh();
@@ -36,45 +105,97 @@ public:
 
     bool addFace( int a, int b, int c );
 
+    // room for this many more vertices and faces, for loaders that know
+    // their counts up front
+    void reserve( size_t num_vertices, size_t num_faces );
+
     char *doubleCheck();
     
     void generateNormals();
-};
 
-class TrimeshFace : public MaterialSceneObject
-{
-    Trimesh *parent;
-    int ids[3];
-public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
-    {
-        this->parent = parent;
-        ids[0] = a;
-        ids[1] = b;
-        ids[2] = c;
-    }
+    // Move the vertices and normals into global space once, so that rays
+    // no longer have to be moved into the mesh's space; the mesh then hangs
+    // from root and no longer follows its old transformation, so this is
+    // only for meshes that do not move.  Call once the mesh is complete.
+    void bakeTransform( TransformNode *root );
 
-    int operator[]( int i ) const
-    {
-        return ids[i];
-    }
+    // build the local-space hierarchy over the faces
+    virtual void buildAccelerator();
 
+    // the mesh is intersected as a whole: the ray is transformed into the
+    // mesh's space once and then walks the face hierarchy
     virtual bool intersectLocal( const ray& r, isect& i ) const;
+    virtual bool occludedLocal( const ray& r, double tMax ) const;
+    virtual void attenuateLocal( const ray& r, double tMax, vec3f& atten ) const;
+
+    // the packet goes through the face hierarchy as a whole
+    virtual void intersectPacket( int count, const ray* const* r, isect* const* i ) const;
+
+    // Queries in the mesh's space for a TrimeshInstance: a packet of rays
+    // already there, and the shadow queries as if the mesh's material let
+    // kt through.
+    void intersectPacketLocal( int count, const ray* const* r, isect* const* i ) const;
+    bool occludedLocal( const ray& r, double tMax, const vec3f& kt ) const;
+    void attenuateLocal( const ray& r, double tMax, const vec3f& kt, vec3f& atten ) const;
+
+    bool hasMaterials() const { return !materials.empty(); }
+
+    // the faces in a leaf of the hierarchy
+    virtual bool intersectPrimitives( int first, int count, const ray& r, double tMax, isect& i ) const;
+    virtual bool occludedPrimitives( int first, int count, const ray& r, double tMax ) const;
+    virtual void attenuatePrimitives( int first, int count, const ray& r, double tMax, vec3f& atten ) const;
+
+    // with per-vertex materials, those replace the mesh's own material
+    virtual bool isTransmissive() const;
 
     virtual bool hasBoundingBoxCapability() const { return true; }
-      
+
     virtual BoundingBox ComputeLocalBoundingBox()
     {
         BoundingBox localbounds;
-        localbounds.max = maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-		localbounds.min = minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-        
-        localbounds.max = maximum( parent->vertices[ids[2]], localbounds.max);
-		localbounds.min = minimum( parent->vertices[ids[2]], localbounds.min);
+        if( vertices.empty() )
+            return localbounds;
+
+        localbounds.max = vertices[0];
+        localbounds.min = vertices[0];
+        for( Vertices::const_iterator vi = vertices.begin(); vi != vertices.end(); ++vi )
+        {
+            localbounds.max = maximum( *vi, localbounds.max );
+            localbounds.min = minimum( *vi, localbounds.min );
+        }
         return localbounds;
     }
-    
+};
+
+
+// One placement of a mesh that is defined once and placed many times:
+// the instance has a transformation and material of its own, but the
+// vertices, faces and face hierarchy are the mesh's, shared by all its
+// instances, so that memory and build time go with the meshes rather than
+// with the instances.  The mesh's per-vertex materials and normals, if it
+// has any, are shared too.  The mesh itself is no object of the scene.
+class TrimeshInstance : public MaterialSceneObject
+{
+    Trimesh *mesh;
+public:
+    TrimeshInstance( Scene *scene, Material *mat, TransformNode *transform, Trimesh *mesh )
+        : MaterialSceneObject(scene, mat), mesh( mesh )
+    {
+        setTransform( transform );
+    }
+
+    // the rays are transformed into the instance's space, which is the
+    // mesh's, and go through its face hierarchy; hits are the instance's
+    virtual bool intersectLocal( const ray& r, isect& i ) const;
+    virtual void intersectPacket( int count, const ray* const* r, isect* const* i ) const;
+    virtual bool occludedLocal( const ray& r, double tMax ) const;
+    virtual void attenuateLocal( const ray& r, double tMax, vec3f& atten ) const;
+
+    virtual bool isTransmissive() const;
+
+    virtual bool hasBoundingBoxCapability() const { return true; }
+
+    virtual BoundingBox ComputeLocalBoundingBox() { return mesh->ComputeLocalBoundingBox(); }
 };
 
 
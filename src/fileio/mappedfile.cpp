@@ -0,0 +1,127 @@
+//
+// mappedfile.cpp
+//
+// The mapping itself is system specific: file mappings on Windows, mmap()
+// elsewhere.  An empty file cannot be mapped, so it is opened with no view.
+//
+
+#include "mappedfile.h"
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+MappedFile::MappedFile()
+	: view( NULL ), length( 0 ), is_open( false ),
+#ifdef WIN32
+	  file( INVALID_HANDLE_VALUE ), mapping( NULL )
+#else
+	  fd( -1 )
+#endif
+{
+}
+
+
+#ifdef WIN32
+
+bool MappedFile::open( const char* path )
+{
+	close();
+
+	file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( file == INVALID_HANDLE_VALUE )
+		return false;
+
+	LARGE_INTEGER file_size;
+	if( !GetFileSizeEx( file, &file_size ) ) {
+		close();
+		return false;
+	}
+	length = (size_t)file_size.QuadPart;
+
+	if( length > 0 ) {
+		mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+		if( mapping == NULL ) {
+			close();
+			return false;
+		}
+
+		view = (const char*)MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+		if( view == NULL ) {
+			close();
+			return false;
+		}
+	}
+
+	is_open = true;
+	return true;
+}
+
+
+void MappedFile::close()
+{
+	if( view != NULL )
+		UnmapViewOfFile( view );
+	if( mapping != NULL )
+		CloseHandle( mapping );
+	if( file != INVALID_HANDLE_VALUE )
+		CloseHandle( file );
+
+	view	= NULL;
+	length	= 0;
+	is_open	= false;
+	mapping	= NULL;
+	file	= INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool MappedFile::open( const char* path )
+{
+	close();
+
+	fd = ::open( path, O_RDONLY );
+	if( fd < 0 )
+		return false;
+
+	struct stat st;
+	if( fstat( fd, &st ) != 0 ) {
+		close();
+		return false;
+	}
+	length = (size_t)st.st_size;
+
+	if( length > 0 ) {
+		void* p = mmap( NULL, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( p == MAP_FAILED ) {
+			close();
+			return false;
+		}
+		view = (const char*)p;
+	}
+
+	is_open = true;
+	return true;
+}
+
+
+void MappedFile::close()
+{
+	if( view != NULL )
+		munmap( (void*)view, length );
+	if( fd >= 0 )
+		::close( fd );
+
+	view	= NULL;
+	length	= 0;
+	is_open	= false;
+	fd		= -1;
+}
+
+#endif
@@ -0,0 +1,47 @@
+//
+// mappedfile.h
+//
+// Read-only memory mapping of a whole file: its contents are paged in by
+// the system as they are touched, rather than read up front.
+//
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+
+#include <stddef.h>
+
+
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile() { close(); }
+
+	// map the file; false if it cannot be opened or mapped
+	bool open( const char* path );
+	void close();
+
+	bool isOpen() const { return is_open; }
+
+	// the contents, valid until close()
+	const char*	data() const { return view; }
+	size_t		size() const { return length; }
+
+private:
+	const char*	view;
+	size_t		length;
+	bool		is_open;
+
+#ifdef WIN32
+	void*		file;
+	void*		mapping;
+#else
+	int			fd;
+#endif
+
+	MappedFile( const MappedFile& );
+	MappedFile& operator =( const MappedFile& );
+};
+
+
+#endif // MAPPEDFILE_H
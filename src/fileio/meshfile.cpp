@@ -0,0 +1,496 @@
+//
+// meshfile.cpp
+//
+// Both readers walk the mapped bytes with a pointer that is checked
+// against the end of the file before every read, as the mapping is not
+// terminated.  Numbers are converted by hand: exactly, as strtod() would,
+// for the usual ones of up to 15 significant digits.
+//
+
+#include <cmath>
+#include <cctype>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include "meshfile.h"
+#include "mappedfile.h"
+#include "../SceneObjects/trimesh.h"
+
+
+// Data Structure
+// A property of a PLY element: a scalar, or a list preceded by its length.
+struct MeshFile_PlyProperty {
+	string	name;
+	int		type;
+	bool	list;
+	int		count_type;			// of the length of a list
+};
+
+struct MeshFile_PlyElement {
+	string							name;
+	long long						count;
+	vector<MeshFile_PlyProperty>	properties;
+};
+
+
+// Static Data
+// the PLY scalar types, by both of their names, and their sizes in binary
+static const char*	MeshFile_ply_types[8][2] = {
+	{ "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+	{ "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" } };
+static const int	MeshFile_ply_sizes[8] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+
+
+// Static Function Prototype
+static bool MeshFile_readOBJ(const char* p, const char* end, Trimesh* mesh, string& error);
+static bool MeshFile_readPLY(const char* p, const char* end, Trimesh* mesh, string& error);
+static bool MeshFile_addPolygon(const vector<int>& polygon, int num_vertices, Trimesh* mesh);
+static const char* MeshFile_skipBlanks(const char* p, const char* end);
+static const char* MeshFile_nextLine(const char* p, const char* end);
+static string MeshFile_word(const char*& p, const char* end);
+static bool MeshFile_parseInt(const char*& p, const char* end, long long& v);
+static bool MeshFile_parseDouble(const char*& p, const char* end, double& v);
+static int MeshFile_plyType(const string& name);
+static bool MeshFile_plyValue(const char*& p, const char* end, int type, bool ascii, bool swap, double& v);
+static string MeshFile_lineError(const char* what, int line);
+
+
+// Operation Handling
+bool readMeshFile( const std::string& path, Trimesh* mesh, std::string& error )
+{
+	MappedFile file;
+	if( !file.open( path.c_str() ) ) {
+		error = "Cannot open mesh file " + path + ".";
+		return false;
+	}
+
+	const size_t dot = path.rfind( '.' );
+	string extension = dot == string::npos ? string() : path.substr( dot + 1 );
+	for( size_t k = 0; k < extension.size(); ++k )
+		extension[k] = (char)tolower( extension[k] );
+
+	const char* data	= file.data();
+	const char* end		= data + file.size();
+
+	bool ok;
+	if( extension == "obj" )
+		ok = MeshFile_readOBJ( data, end, mesh, error );
+	else if( extension == "ply" )
+		ok = MeshFile_readPLY( data, end, mesh, error );
+	else {
+		error = "Mesh file " + path + " is neither .obj nor .ply.";
+		return false;
+	}
+
+	if( !ok )
+		error = path + ": " + error;
+	return ok;
+}
+
+
+// Static Function Implementation
+// Only the v and f lines are read; an index may be negative, counting back
+// from the last vertex so far, and what follows it after a slash (texture
+// coordinate and normal) is skipped.
+static bool MeshFile_readOBJ(const char* p, const char* end, Trimesh* mesh, string& error)
+{
+	int num_vertices = 0;
+	vector<int> polygon;
+
+	for( int line = 1; p < end; p = MeshFile_nextLine( p, end ), ++line ) {
+		p = MeshFile_skipBlanks( p, end );
+		if( end - p < 2 || (p[1] != ' ' && p[1] != '\t') )
+			continue;
+
+		if( p[0] == 'v' ) {
+			p += 2;
+			vec3f v;
+			for( int axis = 0; axis < 3; ++axis ) {
+				p = MeshFile_skipBlanks( p, end );
+				if( !MeshFile_parseDouble( p, end, v[axis] ) ) {
+					error = MeshFile_lineError( "bad vertex", line );
+					return false;
+				}
+			}
+			mesh->addVertex( v );
+			++num_vertices;
+		} else if( p[0] == 'f' ) {
+			p += 2;
+			polygon.clear();
+			for( p = MeshFile_skipBlanks( p, end ); p < end && *p != '\n' && *p != '\r'; p = MeshFile_skipBlanks( p, end ) ) {
+				long long index;
+				if( !MeshFile_parseInt( p, end, index ) || index == 0 ) {
+					error = MeshFile_lineError( "bad face", line );
+					return false;
+				}
+				polygon.push_back( (int)(index > 0 ? index - 1 : num_vertices + index) );
+
+				while( p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' )
+					++p;
+			}
+			if( !MeshFile_addPolygon( polygon, num_vertices, mesh ) ) {
+				error = MeshFile_lineError( "bad face", line );
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+// The header lists the elements, each with its properties, in the order
+// they follow it.  Of the vertices, x, y and z make the position, and nx,
+// ny and nz the normal if all three are there; of the faces, the list
+// vertex_indices (or vertex_index).  Anything else is read past.
+static bool MeshFile_readPLY(const char* p, const char* end, Trimesh* mesh, string& error)
+{
+	if( MeshFile_word( p, end ) != "ply" ) {
+		error = "not a PLY file";
+		return false;
+	}
+
+	bool ascii = false;
+	bool swap = false;
+	vector<MeshFile_PlyElement> elements;
+
+	for( p = MeshFile_nextLine( p, end ); ; p = MeshFile_nextLine( p, end ) ) {
+		if( p >= end ) {
+			error = "no end_header";
+			return false;
+		}
+
+		const string keyword = MeshFile_word( p, end );
+		if( keyword == "end_header" ) {
+			p = MeshFile_nextLine( p, end );
+			break;
+		}
+
+		if( keyword == "format" ) {
+			const string format = MeshFile_word( p, end );
+			const unsigned short one = 1;
+			const bool little = *(const unsigned char*)&one == 1;
+			if( format == "ascii" )						ascii = true;
+			else if( format == "binary_little_endian" )	swap = !little;
+			else if( format == "binary_big_endian" )	swap = little;
+			else {
+				error = "unknown format " + format;
+				return false;
+			}
+		} else if( keyword == "element" ) {
+			MeshFile_PlyElement element;
+			element.name = MeshFile_word( p, end );
+			p = MeshFile_skipBlanks( p, end );
+			if( !MeshFile_parseInt( p, end, element.count ) || element.count < 0 ) {
+				error = "bad element " + element.name;
+				return false;
+			}
+			elements.push_back( element );
+		} else if( keyword == "property" ) {
+			if( elements.empty() ) {
+				error = "property before any element";
+				return false;
+			}
+
+			MeshFile_PlyProperty property;
+			string type = MeshFile_word( p, end );
+			property.list = type == "list";
+			property.count_type = -1;
+			if( property.list ) {
+				property.count_type = MeshFile_plyType( MeshFile_word( p, end ) );
+				type = MeshFile_word( p, end );
+			}
+			property.type = MeshFile_plyType( type );
+			property.name = MeshFile_word( p, end );
+			if( property.type < 0 || (property.list && property.count_type < 0) ) {
+				error = "bad property " + property.name;
+				return false;
+			}
+			elements.back().properties.push_back( property );
+		}
+		// comment, obj_info and the like say nothing about the data
+	}
+
+	for( size_t e = 0; e < elements.size(); ++e ) {
+		const MeshFile_PlyElement& element = elements[e];
+		const vector<MeshFile_PlyProperty>& properties = element.properties;
+		const bool is_vertex = element.name == "vertex";
+		const bool is_face = element.name == "face";
+
+		// where each property goes: 0-2 position, 3-5 normal, 6 the face
+		// list, -1 nowhere
+		vector<int> slot( properties.size(), -1 );
+		int num_normal = 0;
+		for( size_t k = 0; k < properties.size(); ++k ) {
+			const string& name = properties[k].name;
+			if( is_vertex && !properties[k].list ) {
+				if( name == "x" )		slot[k] = 0;
+				else if( name == "y" )	slot[k] = 1;
+				else if( name == "z" )	slot[k] = 2;
+				else if( name == "nx" )	slot[k] = 3;
+				else if( name == "ny" )	slot[k] = 4;
+				else if( name == "nz" )	slot[k] = 5;
+				if( slot[k] >= 3 ) ++num_normal;
+			} else if( is_face && properties[k].list && (name == "vertex_indices" || name == "vertex_index") ) {
+				slot[k] = 6;
+			}
+		}
+		const bool normals = num_normal == 3;
+
+		// the header is not trusted with the count: every element takes at
+		// least its scalars and list lengths in binary, or a digit and a
+		// blank per property in ascii, which the rest of the file must hold
+		long long min_size = 0;
+		for( size_t k = 0; k < properties.size(); ++k )
+			min_size += ascii ? 2 : MeshFile_ply_sizes[properties[k].list ? properties[k].count_type : properties[k].type];
+		if( element.count > (end - p + 1) / max( min_size, 1LL ) ) {
+			error = "truncated " + element.name + " data";
+			return false;
+		}
+
+		if( is_vertex )
+			mesh->reserve( (size_t)element.count, 0 );
+		else if( is_face )
+			mesh->reserve( 0, (size_t)element.count );
+
+		vector<int> polygon;
+		for( long long n = 0; n < element.count; ++n ) {
+			double values[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+			polygon.clear();
+
+			for( size_t k = 0; k < properties.size(); ++k ) {
+				const MeshFile_PlyProperty& property = properties[k];
+				if( ascii ) p = MeshFile_skipBlanks( p, end );
+
+				if( !property.list ) {
+					double v;
+					if( !MeshFile_plyValue( p, end, property.type, ascii, swap, v ) ) {
+						error = "truncated " + element.name + " data";
+						return false;
+					}
+					if( slot[k] >= 0 ) values[slot[k]] = v;
+					continue;
+				}
+
+				// so is the length of a list, before it is made an integer
+				double count;
+				if( !MeshFile_plyValue( p, end, property.count_type, ascii, swap, count ) || count < 0.0 ||
+					count * (ascii ? 2 : MeshFile_ply_sizes[property.type]) > (double)(end - p + 1) ) {
+					error = "truncated " + element.name + " data";
+					return false;
+				}
+				for( long long j = 0; j < (long long)count; ++j ) {
+					double v;
+					if( ascii ) p = MeshFile_skipBlanks( p, end );
+					if( !MeshFile_plyValue( p, end, property.type, ascii, swap, v ) ) {
+						error = "truncated " + element.name + " data";
+						return false;
+					}
+					// an index out of range is left for MeshFile_addPolygon() to reject
+					if( slot[k] == 6 ) polygon.push_back( v >= 0.0 && v < (double)INT_MAX ? (int)v : -1 );
+				}
+			}
+
+			if( ascii ) p = MeshFile_nextLine( p, end );
+
+			if( is_vertex ) {
+				mesh->addVertex( vec3f( values[0], values[1], values[2] ) );
+				if( normals ) mesh->addNormal( vec3f( values[3], values[4], values[5] ) );
+			} else if( is_face && !MeshFile_addPolygon( polygon, INT_MAX, mesh ) ) {
+				error = "bad face";
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+// fan the polygon out into triangles; false if it has fewer than three
+// vertices, or one that is not in 0 .. num_vertices - 1 or not in the mesh
+static bool MeshFile_addPolygon(const vector<int>& polygon, int num_vertices, Trimesh* mesh)
+{
+	if( polygon.size() < 3 )
+		return false;
+
+	for( size_t k = 0; k < polygon.size(); ++k ) {
+		if( polygon[k] < 0 || polygon[k] >= num_vertices )
+			return false;
+	}
+
+	for( size_t k = 2; k < polygon.size(); ++k ) {
+		if( !mesh->addFace( polygon[0], polygon[k - 1], polygon[k] ) )
+			return false;
+	}
+	return true;
+}
+
+
+// past spaces and tabs, but not the end of the line
+static const char* MeshFile_skipBlanks(const char* p, const char* end)
+{
+	while( p < end && (*p == ' ' || *p == '\t') )
+		++p;
+	return p;
+}
+
+
+// the start of the line after the one p is in
+static const char* MeshFile_nextLine(const char* p, const char* end)
+{
+	const char* newline = (const char*)memchr( p, '\n', end - p );
+	return newline != NULL ? newline + 1 : end;
+}
+
+
+// the next word on the line, or an empty one at its end
+static string MeshFile_word(const char*& p, const char* end)
+{
+	p = MeshFile_skipBlanks( p, end );
+	const char* begin = p;
+	while( p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' )
+		++p;
+	return string( begin, p );
+}
+
+
+static bool MeshFile_parseInt(const char*& p, const char* end, long long& v)
+{
+	const bool negative = p < end && *p == '-';
+	if( p < end && (*p == '-' || *p == '+') ) ++p;
+	if( p >= end || *p < '0' || *p > '9' ) return false;
+
+	v = 0;
+	while( p < end && *p >= '0' && *p <= '9' ) {
+		if( v > (LLONG_MAX - 9) / 10 ) return false;
+		v = v * 10 + (*p++ - '0');
+	}
+	if( negative ) v = -v;
+	return true;
+}
+
+
+// The digits are gathered into an integer, and the decimal exponent
+// applied with one multiplication or division: exact while both fit in a
+// double, which takes up to 15 digits and powers up to 10^22.
+static bool MeshFile_parseDouble(const char*& p, const char* end, double& v)
+{
+	static const double powers[23] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	const bool negative = p < end && *p == '-';
+	if( p < end && (*p == '-' || *p == '+') ) ++p;
+
+	unsigned long long mantissa = 0;
+	int exponent = 0;
+	int digits = 0;
+	bool any = false;
+
+	for( ; p < end && *p >= '0' && *p <= '9'; ++p, any = true ) {
+		if( digits < 19 ) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if( mantissa != 0 ) ++digits;
+		} else {
+			++exponent;
+		}
+	}
+	if( p < end && *p == '.' ) {
+		for( ++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true ) {
+			if( digits < 19 ) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if( mantissa != 0 ) ++digits;
+				--exponent;
+			}
+		}
+	}
+	if( !any ) {
+		// inf and nan, as some exporters write them
+		if( end - p >= 3 && (strncmp( p, "inf", 3 ) == 0 || strncmp( p, "nan", 3 ) == 0) ) {
+			v = p[0] == 'i' ? HUGE_VAL : numeric_limits<double>::quiet_NaN();
+			if( negative ) v = -v;
+			p += 3;
+			return true;
+		}
+		return false;
+	}
+
+	if( p < end && (*p == 'e' || *p == 'E') ) {
+		const char* q = p + 1;
+		long long e;
+		if( MeshFile_parseInt( q, end, e ) ) {
+			exponent += (int)max( -100000LL, min( e, 100000LL ) );
+			p = q;
+		}
+	}
+
+	v = (double)mantissa;
+	if( mantissa != 0 && exponent != 0 ) {
+		if( digits <= 15 && exponent < 0 && exponent >= -22 )
+			v /= powers[-exponent];
+		else if( digits <= 15 && exponent > 0 && exponent <= 22 )
+			v *= powers[exponent];
+		else
+			v *= pow( 10.0, (double)exponent );
+	}
+	if( negative ) v = -v;
+	return true;
+}
+
+
+// the index of a PLY type by either of its names, -1 if unknown
+static int MeshFile_plyType(const string& name)
+{
+	for( int k = 0; k < 8; ++k ) {
+		if( name == MeshFile_ply_types[k][0] || name == MeshFile_ply_types[k][1] )
+			return k;
+	}
+	return -1;
+}
+
+
+static bool MeshFile_plyValue(const char*& p, const char* end, int type, bool ascii, bool swap, double& v)
+{
+	if( ascii )
+		return MeshFile_parseDouble( p, end, v );
+
+	const int size = MeshFile_ply_sizes[type];
+	if( end - p < size )
+		return false;
+
+	unsigned char bytes[8];
+	memcpy( bytes, p, size );
+	p += size;
+	if( swap ) {
+		for( int k = 0; k < size / 2; ++k ) {
+			const unsigned char b = bytes[k];
+			bytes[k] = bytes[size - 1 - k];
+			bytes[size - 1 - k] = b;
+		}
+	}
+
+	switch( type ) {
+	case 0: { signed char x;		memcpy( &x, bytes, 1 ); v = x; break; }
+	case 1: { unsigned char x;		memcpy( &x, bytes, 1 ); v = x; break; }
+	case 2: { short x;				memcpy( &x, bytes, 2 ); v = x; break; }
+	case 3: { unsigned short x;		memcpy( &x, bytes, 2 ); v = x; break; }
+	case 4: { int x;				memcpy( &x, bytes, 4 ); v = x; break; }
+	case 5: { unsigned int x;		memcpy( &x, bytes, 4 ); v = x; break; }
+	case 6: { float x;				memcpy( &x, bytes, 4 ); v = x; break; }
+	default: { double x;			memcpy( &x, bytes, 8 ); v = x; break; }
+	}
+	return true;
+}
+
+
+static string MeshFile_lineError(const char* what, int line)
+{
+	char buf[64];
+	sprintf( buf, "%s on line %d", what, line );
+	return string( buf );
+}
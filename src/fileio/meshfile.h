@@ -0,0 +1,27 @@
+//
+// meshfile.h
+//
+// Triangle meshes read from OBJ and PLY files, for the file field of a
+// trimesh in a .ray file.  The file is memory-mapped and parsed in place,
+// without streams, straight into the mesh's vertex and index arrays.
+// PLY may be ASCII or binary of either byte order.  Faces with more than
+// three vertices are split into a fan, as those of a .ray file are.
+//
+
+#ifndef MESHFILE_H
+#define MESHFILE_H
+
+
+#include <string>
+
+class Trimesh;
+
+
+// Read the mesh in the file at path into mesh, which has no vertices or
+// faces yet, by the file's extension; false, with the reason in error, if
+// it cannot.  PLY vertex normals (nx, ny, nz) are kept; OBJ normals and
+// texture coordinates, which are given per face corner, are left out.
+bool readMeshFile( const std::string& path, Trimesh* mesh, std::string& error );
+
+
+#endif // MESHFILE_H
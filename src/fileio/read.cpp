@@ -11,6 +11,7 @@
 
 #include "read.h"
 #include "parse.h"
+#include "meshfile.h"
 
 #include "../scene/scene.h"
 #include "../SceneObjects/trimesh.h"
@@ -24,6 +25,14 @@
 
 typedef map<string,Material*> mmap;
 
+// the directory of the scene file being read, which the files it refers
+// to are relative to
+static string sceneDirectory;
+
+// the meshes defined by name for instances to place, owned by the scene
+typedef map<string,Trimesh*> tmap;
+static tmap meshes;
+
 static void processObject( Obj *obj, Scene *scene, mmap& materials );
 static Obj *getColorField( Obj *obj );
 static Obj *getField( Obj *obj, const string& name );
@@ -33,7 +42,12 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 	const mmap& materials, TransformNode *transform );
 static void processTrimesh( string name, Obj *child, Scene *scene,
                                      const mmap& materials, TransformNode *transform );
+static void processTrimeshFaces( Obj *child, Trimesh *tmesh, const mmap& materials );
+static void processMesh( Obj *child, Scene *scene, const mmap& materials );
+static void processInstance( Obj *child, Scene *scene,
+                                     const mmap& materials, TransformNode *transform );
 static void processCamera( Obj *child, Scene *scene );
+static void processAccelerator( Obj *child, Scene *scene );
 static Material *getMaterial( Obj *child, const mmap& bindings );
 static Material *processMaterial( Obj *child, mmap *bindings = NULL );
 static void verifyTuple( const mytuple& tup, size_t size );
@@ -46,6 +60,9 @@ Scene *readScene( const string& filename )
 		return NULL;
 	}
 
+	const size_t slash = filename.find_last_of( "/\\" );
+	sceneDirectory = slash == string::npos ? string() : filename.substr( 0, slash + 1 );
+
 	try {
 		return readScene( ifs );
 	} catch( ParseError& pe ) {
@@ -90,6 +107,7 @@ Scene *readScene( istream& is )
 
 	// vector<Obj*> result;
 	mmap materials;
+	meshes.clear();
 
 	while( true ) {
 		Obj *cur = readFile( is );
@@ -295,6 +313,9 @@ static void processGeometry( string name, Obj *child, Scene *scene,
                                                              l4[3]->getScalar() ) ) ) );
 	} else if( name == "trimesh" || name == "polymesh" ) { // 'polymesh' is for backwards compatibility
         processTrimesh( name, child, scene, materials, transform);
+    } else if( name == "instance" ) {
+        if( child == NULL ) throw ParseError( "No info for instance" );
+        processInstance( child, scene, materials, transform );
     } else {
 		SceneObject *obj = NULL;
        	Material *mat;
@@ -343,30 +364,93 @@ static void processTrimesh(string name, Obj *child, Scene *scene, const mmap& ma
         mat = new Material();
     
     Trimesh *tmesh = new Trimesh( scene, mat, transform);
+    processTrimeshFaces( child, tmesh, materials );
 
-    const mytuple &points = getField( child, "points" )->getTuple();
-    for( mytuple::const_iterator pi = points.begin(); pi != points.end(); ++pi )
-        tmesh->addVertex( tupleToVec( *pi ) );
-                
-    const mytuple &faces = getField( child, "faces" )->getTuple();
-    for( mytuple::const_iterator fi = faces.begin(); fi != faces.end(); ++fi )
-    {
-        const mytuple &pointids = (*fi)->getTuple();
+    // a mesh that will not move can be intersected in global space
+    bool bake = false;
+    maybeExtractField( child, "bake", bake );
+    if( bake )
+        tmesh->bakeTransform( &scene->transformRoot );
 
-        // triangulate here and now.  assume the poly is
-        // concave and we can triangulate using an arbitrary fan
-        if( pointids.size() < 3 )
-            throw ParseError( "Faces must have at least 3 vertices." );
+    scene->add(tmesh);
+}
+
+// A mesh defined once, by name, to be placed by any number of instances.
+// It takes the fields of a trimesh that make up its shape, but neither a
+// material nor a transformation, which are the instances'.
+static void processMesh( Obj *child, Scene *scene, const mmap& materials )
+{
+    const string name = getField( child, "name" )->getString();
+    if( meshes.find( name ) != meshes.end() )
+        throw ParseError( "Mesh " + name + " is defined twice." );
 
-        mytuple::const_iterator i = pointids.begin();
-        int a = (int) (*i++)->getScalar();
-        int b = (int) (*i++)->getScalar();
-        while( i != pointids.end() )
+    Trimesh *tmesh = new Trimesh( scene, new Material(), &scene->transformRoot );
+    scene->addShared( tmesh );
+    meshes[ name ] = tmesh;
+
+    processTrimeshFaces( child, tmesh, materials );
+}
+
+static void processInstance( Obj *child, Scene *scene, const mmap& materials, TransformNode *transform )
+{
+    const string name = getField( child, "mesh" )->getString();
+    tmap::const_iterator mi = meshes.find( name );
+    if( mi == meshes.end() )
+        throw ParseError( "Instance of undefined mesh " + name + "." );
+
+    Material *mat;
+    if( hasField( child, "material" ) )
+        mat = getMaterial( getField( child, "material" ), materials );
+    else
+        mat = new Material();
+
+    scene->add( new TrimeshInstance( scene, mat, transform, mi->second ) );
+}
+
+// The vertices and faces of a trimesh or mesh, with their normals and
+// per-vertex materials.
+static void processTrimeshFaces( Obj *child, Trimesh *tmesh, const mmap& materials )
+{
+    // the mesh may come from an OBJ or PLY file instead, relative to the
+    // scene file unless its path is absolute
+    if( hasField( child, "file" ) )
+    {
+        string path = getField( child, "file" )->getString();
+        const bool absolute = !path.empty() &&
+            (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'));
+        if( !absolute )
+            path = sceneDirectory + path;
+
+        string error;
+        if( !readMeshFile( path, tmesh, error ) )
+            throw ParseError( error );
+    }
+    else
+    {
+        const mytuple &points = getField( child, "points" )->getTuple();
+        for( mytuple::const_iterator pi = points.begin(); pi != points.end(); ++pi )
+            tmesh->addVertex( tupleToVec( *pi ) );
+
+        const mytuple &faces = getField( child, "faces" )->getTuple();
+        for( mytuple::const_iterator fi = faces.begin(); fi != faces.end(); ++fi )
         {
-            int c = (int) (*i++)->getScalar();
-            if( !tmesh->addFace(a,b,c) )
-                throw ParseError( "Bad face in trimesh." );
-            b = c;
+            const mytuple &pointids = (*fi)->getTuple();
+
+            // triangulate here and now.  assume the poly is
+            // concave and we can triangulate using an arbitrary fan
+            if( pointids.size() < 3 )
+                throw ParseError( "Faces must have at least 3 vertices." );
+
+            mytuple::const_iterator i = pointids.begin();
+            int a = (int) (*i++)->getScalar();
+            int b = (int) (*i++)->getScalar();
+            while( i != pointids.end() )
+            {
+                int c = (int) (*i++)->getScalar();
+                if( !tmesh->addFace(a,b,c) )
+                    throw ParseError( "Bad face in trimesh." );
+                b = c;
+            }
         }
     }
 
@@ -391,8 +475,6 @@ static void processTrimesh(string name, Obj *child, Scene *scene, const mmap& ma
     char *error;
     if( error = tmesh->doubleCheck() )
         throw ParseError( error );
-
-    scene->add(tmesh);
 }
 
 
@@ -500,6 +582,35 @@ static void processCamera( Obj *child, Scene *scene ) {
 }
 
 
+// Choose the structure used to find ray intersections, and how compact
+// the nodes of wide BVHs are, e.g.
+//     accelerator { type = "grid"; }
+//     accelerator { type = "widebvh"; nodes = "quantized8"; }
+static void processAccelerator( Obj *child, Scene *scene ) {
+    if( hasField( child, "type" ) ) {
+        Obj *field = getField( child, "type" );
+        string name = field->getTypeName() == "id" ? field->getID() : field->getString();
+
+        Scene_Accelerator_Method method;
+        if( !Scene::getAcceleratorMethod( name, method ) )
+            throw ParseError( string( "Unknown accelerator: " ) + name );
+
+        scene->setAcceleratorMethod( method );
+    }
+
+    if( hasField( child, "nodes" ) ) {
+        Obj *field = getField( child, "nodes" );
+        string name = field->getTypeName() == "id" ? field->getID() : field->getString();
+
+        Scene_Node_Format format;
+        if( !Scene::getNodeFormat( name, format ) )
+            throw ParseError( string( "Unknown node format: " ) + name );
+
+        scene->setNodeFormat( format );
+    }
+}
+
+
 static void processObject( Obj *obj, Scene *scene, mmap& materials ) {
 	// Assume the object is named.
 	string name;
@@ -565,13 +676,20 @@ static void processObject( Obj *obj, Scene *scene, mmap& materials ) {
 				name == "scale" ||
 				name == "transform" ||
                 name == "trimesh" ||
-                name == "polymesh") { // polymesh is for backwards compatibility.
+                name == "polymesh" || // polymesh is for backwards compatibility.
+                name == "instance") {
 		processGeometry( name, child, scene, materials, &scene->transformRoot);
 		//scene->add( geo );
 	} else if( name == "material" ) {
 		processMaterial( child, &materials );
+	} else if( name == "mesh" ) {
+		if( child == NULL ) throw ParseError( "No info for mesh" );
+		processMesh( child, scene, materials );
 	} else if( name == "camera" ) {
 		processCamera( child, scene );
+	} else if( name == "accelerator" ) {
+		if( child == NULL ) throw ParseError( "No info for accelerator" );
+		processAccelerator( child, scene );
 	} else {
 		throw ParseError( string( "Unrecognized object: " ) + name );
 	}
@@ -88,16 +88,31 @@ int recursion_depth = 0;
 int g_height;
 int g_width = 150;
 bool bReport = false;
-char *progname, *rayName, *imgName;
+bool bCache = false;
+bool bReorder = false;
+int light_samples = 0;
+double light_cutoff = 0.0;
+char *progname, *rayName, *imgName, *acceleratorName = NULL, *nodeFormatName = NULL;
 
 void usage()
 {
 #ifdef WIN32
-	fl_alert( "usage: %s [-r <#> -w <#> -t] [input.ray output.bmp]\n", progname );
+	fl_alert( "usage: %s [-r <#> -w <#> -a <list|bvh|grid|widebvh|sbvh> -n <float|quantized16|quantized8> -c -m -l <#> -i <#> -t] [input.ray output.bmp]\n", progname );
 #else
 	fprintf( stderr, "usage: %s [options] [input.ray output.bmp]\n", progname );
 	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", recursion_depth );
 	fprintf( stderr, "  -w <#>      set output image width (default %d)\n", g_width );
+	fprintf( stderr, "  -a <name>   set acceleration structure: list, bvh, grid, widebvh or sbvh\n" );
+	fprintf( stderr, "              (default: as in the scene file, else bvh)\n" );
+	fprintf( stderr, "  -n <name>   set wide BVH node format: float, quantized16 or quantized8\n" );
+	fprintf( stderr, "              (default: as in the scene file, else float)\n" );
+	fprintf( stderr, "  -c          cache the acceleration structures in input.ray.accel\n" );
+	fprintf( stderr, "  -m          sort mesh faces along a Morton curve and their vertices\n" );
+	fprintf( stderr, "              by first use, for locality\n" );
+	fprintf( stderr, "  -l <#>      shade with # point lights picked per point from a light tree\n" );
+	fprintf( stderr, "              (default: all lights)\n" );
+	fprintf( stderr, "  -i <#>      leave out point lights where they give less than #\n" );
+	fprintf( stderr, "              (default 0: never)\n" );
 	fprintf( stderr, "  -t			report time statistics\n" );
 #endif
 }
@@ -105,13 +120,21 @@ void usage()
 bool processArgs(int argc, char **argv) {
 	int i;
 
-    while ( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+    while ( (i = getopt( argc, argv, "tcmr:w:h:a:n:l:i:" )) != EOF )
 	{
 		switch ( i )
 		{
 			case 't':
 			bReport = true;
 			break;
+
+			case 'c':
+			bCache = true;
+			break;
+
+			case 'm':
+			bReorder = true;
+			break;
 	    
 			case 'r':
 			recursion_depth = atoi( optarg );
@@ -125,6 +148,22 @@ bool processArgs(int argc, char **argv) {
 			g_height = atoi( optarg );
 			break;
 
+			case 'a':
+			acceleratorName = optarg;
+			break;
+
+			case 'n':
+			nodeFormatName = optarg;
+			break;
+
+			case 'l':
+			light_samples = atoi( optarg );
+			break;
+
+			case 'i':
+			light_cutoff = atof( optarg );
+			break;
+
 			default:
 			return false;
 		}
@@ -161,6 +200,32 @@ int main(int argc, char **argv) {
 		}
 		
 		theRayTracer = new RayTracer();
+
+		if (acceleratorName) {
+			Scene_Accelerator_Method method;
+			if (!Scene::getAcceleratorMethod(acceleratorName, method)) {
+				fprintf( stderr, "unknown acceleration structure %s.\n", acceleratorName );
+				usage();
+				exit(1);
+			}
+			theRayTracer->setAcceleratorMethod(method);
+		}
+
+		theRayTracer->setAcceleratorCache(bCache);
+		theRayTracer->setMeshReordering(bReorder);
+		theRayTracer->setLightSamples(light_samples);
+		theRayTracer->setLightCutoff(light_cutoff);
+
+		if (nodeFormatName) {
+			Scene_Node_Format format;
+			if (!Scene::getNodeFormat(nodeFormatName, format)) {
+				fprintf( stderr, "unknown node format %s.\n", nodeFormatName );
+				usage();
+				exit(1);
+			}
+			theRayTracer->setNodeFormat(format);
+		}
+
 		theRayTracer->loadScene(rayName);
 	
 		if (theRayTracer->sceneLoaded()) {
@@ -184,10 +249,23 @@ int main(int argc, char **argv) {
 
 			if (bReport) {
 				double t=(double)(end-start)/CLOCKS_PER_SEC;
+				double tb=theRayTracer->getBuildTime();
+				unsigned long long hits, misses;
+				theRayTracer->getOccluderCacheStats(hits, misses);
+				double rate = hits + misses ? 100.0 * hits / (hits + misses) : 0.0;
+				double stride_before, stride_after;
+				theRayTracer->getVertexStride(stride_before, stride_after);
 #ifdef WIN32
-				fl_message( "total time = %.3f seconds\n", t); 
+				fl_message( "build time = %.3f seconds\nrender time = %.3f seconds\n"
+					"occluder cache = %llu hits, %llu misses (%.1f%%)\n", tb, t, hits, misses, rate); 
+				if (bReorder)
+					fl_message( "vertex fetch stride = %.0f bytes before reordering, %.0f after\n", stride_before, stride_after); 
 #else
-				fprintf( stderr, "total time = %.3f seconds\n", t); 
+				fprintf( stderr, "build time = %.3f seconds\n", tb); 
+				fprintf( stderr, "render time = %.3f seconds\n", t); 
+				fprintf( stderr, "occluder cache = %llu hits, %llu misses (%.1f%%)\n", hits, misses, rate); 
+				if (bReorder)
+					fprintf( stderr, "vertex fetch stride = %.0f bytes before reordering, %.0f after\n", stride_before, stride_after); 
 #endif
 			}
 		}
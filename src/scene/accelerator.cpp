@@ -0,0 +1,164 @@
+#include "accelerator.h"
+
+
+// Data Structure
+// Stops at the first opaque object in front of tMax, whichever it is.
+class OcclusionVisitor: public AcceleratorVisitor {
+public:
+	bool		blocked;
+	bool		local;
+	Geometry	*blocker;
+
+	OcclusionVisitor( bool local )
+		: blocked( false ), local( local ), blocker( NULL ) {}
+
+	virtual bool visit( Geometry *obj, const ray& r, double& tMax )
+	{
+		blocked = local ? obj->occludedLocal( r, tMax ) : obj->occluded( r, tMax );
+		if( blocked ) blocker = obj;
+		return !blocked;
+	}
+
+	virtual bool visitPrimitives( const PrimitiveIntersector& owner, int first, int count, const ray& r, double& tMax )
+	{
+		blocked = owner.occludedPrimitives( first, count, r, tMax );
+		return !blocked;
+	}
+};
+
+
+// Data Structure
+// Multiplies in the transmission of every object, whatever the order, until
+// nothing worth tracing is left.
+class AttenuationVisitor: public AcceleratorVisitor {
+public:
+	vec3f&		atten;
+	double		threshold;
+	bool		local;
+	Geometry	*last;			// the object that was visited last
+
+	AttenuationVisitor( vec3f& atten, double threshold, bool local )
+		: atten( atten ), threshold( threshold ), local( local ), last( NULL ) {}
+
+	bool negligible() const
+	{ return atten[0] <= threshold && atten[1] <= threshold && atten[2] <= threshold; }
+
+	virtual bool visit( Geometry *obj, const ray& r, double& tMax )
+	{
+		if( local )	obj->attenuateLocal( r, tMax, atten );
+		else		obj->attenuate( r, tMax, atten );
+		last = obj;
+		return !negligible();
+	}
+
+	virtual bool visitPrimitives( const PrimitiveIntersector& owner, int first, int count, const ray& r, double& tMax )
+	{
+		owner.attenuatePrimitives( first, count, r, tMax, atten );
+		return !negligible();
+	}
+};
+
+
+// Operation Handling
+bool ClosestHitVisitor::visit( Geometry *obj, const ray& r, double& tMax )
+{
+	isect cur;
+	const bool hit = local ? obj->intersectLocal( r, cur ) : obj->intersect( r, cur );
+
+	if( hit && cur.t < tMax ) {
+		i = cur;
+		tMax = cur.t;
+		have_one = true;
+	}
+	return true;
+}
+
+
+bool ClosestHitVisitor::visitPrimitives( const PrimitiveIntersector& owner, int first, int count, const ray& r, double& tMax )
+{
+	isect cur;
+	if( owner.intersectPrimitives( first, count, r, tMax, cur ) ) {
+		i = cur;
+		tMax = cur.t;
+		have_one = true;
+	}
+	return true;
+}
+
+
+
+bool Accelerator::intersect( const ray& r, isect& i ) const
+{
+	ClosestHitVisitor visitor( i, false );
+	traverse( r, 1.0e308, visitor );
+	return visitor.have_one;
+}
+
+
+bool Accelerator::intersectLocal( const ray& r, isect& i ) const
+{
+	ClosestHitVisitor visitor( i, true );
+	traverse( r, 1.0e308, visitor );
+	return visitor.have_one;
+}
+
+
+bool Accelerator::occluded( const ray& r, double tMax, Geometry** blocker ) const
+{
+	OcclusionVisitor visitor( false );
+	traverse( r, tMax, visitor );
+	if( blocker != NULL ) *blocker = visitor.blocker;
+	return visitor.blocked;
+}
+
+
+bool Accelerator::occludedLocal( const ray& r, double tMax ) const
+{
+	OcclusionVisitor visitor( true );
+	traverse( r, tMax, visitor );
+	return visitor.blocked;
+}
+
+
+bool Accelerator::attenuate( const ray& r, double tMax, double threshold, vec3f& atten, Geometry** blocker ) const
+{
+	AttenuationVisitor visitor( atten, threshold, false );
+	traverse( r, tMax, visitor );
+	if( !visitor.negligible() )
+		return true;
+
+	if( blocker != NULL ) *blocker = visitor.last;
+	return false;
+}
+
+
+bool Accelerator::attenuateLocal( const ray& r, double tMax, double threshold, vec3f& atten ) const
+{
+	AttenuationVisitor visitor( atten, threshold, true );
+	traverse( r, tMax, visitor );
+	return !visitor.negligible();
+}
+
+
+void Accelerator::intersectPacket( int count, const ray* const* r, isect* const* i, const Frustum* frustum ) const
+{
+	tracePacket( count, r, i, false, frustum );
+}
+
+
+void Accelerator::intersectPacketLocal( int count, const ray* const* r, isect* const* i ) const
+{
+	tracePacket( count, r, i, true, NULL );
+}
+
+
+// A ray on its own only ever reaches the parts of the structure that it
+// crosses, which the frustum holding it overlaps, so there is nothing left
+// for the frustum to cull.
+void Accelerator::tracePacket( int count, const ray* const* r, isect* const* i, bool local, const Frustum* /*frustum*/ ) const
+{
+	for( int k = 0; k < count; ++k ) {
+		ClosestHitVisitor visitor( *i[k], local );
+		traverse( *r[k], i[k]->obj != NULL ? i[k]->t : 1.0e308, visitor );
+	}
+}
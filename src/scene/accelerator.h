@@ -0,0 +1,176 @@
+//
+// accelerator.h
+//
+// The interface shared by the spatial structures that Scene::intersect()
+// can use to find the objects a ray may hit, without testing them all.
+//
+
+#ifndef __ACCELERATOR_H__
+#define __ACCELERATOR_H__
+
+
+#include <list>
+#include <vector>
+#include <cstring>
+
+#include "scene.h"
+
+
+// An object made of many parts that are no Geometry of their own, such as
+// the triangles of a mesh, for a structure built over those parts with
+// BVH::buildPrimitives().  The parts are numbered by their position in the
+// structure's primitive order, and rays come in the space it was built in.
+class PrimitiveIntersector {
+public:
+	virtual ~PrimitiveIntersector() {}
+
+	// The nearest hit before tMax among the primitives [first, first +
+	// count), put in i; false if there is none.
+	virtual bool intersectPrimitives( int first, int count, const ray& r, double tMax, isect& i ) const = 0;
+
+	// Is any of them an opaque blocker of the ray before tMax?
+	virtual bool occludedPrimitives( int first, int count, const ray& r, double tMax ) const = 0;
+
+	// Multiply atten by what each of them lets through before tMax.
+	virtual void attenuatePrimitives( int first, int count, const ray& r, double tMax, vec3f& atten ) const = 0;
+};
+
+
+// Receives the objects a ray may hit, in roughly front-to-back order.
+// The different ray queries (closest hit, shadow tests, ...) are written as
+// visitors so that every acceleration structure supports all of them.
+class AcceleratorVisitor {
+public:
+	virtual ~AcceleratorVisitor() {}
+
+	// Test one candidate object.  Lowering tMax culls everything farther
+	// away along the ray; returning false stops the traversal altogether.
+	virtual bool visit( Geometry *obj, const ray& r, double& tMax ) = 0;
+
+	// Test the primitives [first, first + count) of owner, in a structure
+	// built over primitives; the same holds as for visit().
+	virtual bool visitPrimitives( const PrimitiveIntersector& owner, int first, int count, const ray& r, double& tMax ) = 0;
+};
+
+
+// Keeps the nearest hit seen so far and culls everything behind it.
+class ClosestHitVisitor: public AcceleratorVisitor {
+public:
+	isect&	i;
+	bool	have_one;
+	bool	local;
+
+	ClosestHitVisitor( isect& i, bool local )
+		: i( i ), have_one( false ), local( local ) {}
+
+	virtual bool visit( Geometry *obj, const ray& r, double& tMax );
+	virtual bool visitPrimitives( const PrimitiveIntersector& owner, int first, int count, const ray& r, double& tMax );
+};
+
+
+class Accelerator {
+public:
+	virtual ~Accelerator() {}
+
+	// Build the structure over the given objects, all of which fall within
+	// the given bounds.
+	virtual void build( const list<Geometry*>& objs, const BoundingBox& bounds ) = 0;
+
+	// Adapt the structure to the current bounding boxes of the objects it
+	// was built over, which may have moved since, without rebuilding it.
+	// Returns false if the structure should be rebuilt instead: because it
+	// cannot be refitted, which is the default, or because the refitted one
+	// has become much worse than a new one would be.
+	virtual bool refit() { return false; }
+
+	// Saving the built structure, for AcceleratorCache: write() appends it
+	// to out with the objects as indices into objs, the objects it was
+	// built over; read() restores it from what write() produced for the
+	// same objects, advancing data.  Both fail by default, for structures
+	// that cannot be saved, and read() also on data from another kind of
+	// structure or build option.
+	virtual bool write( vector<char>& /*out*/, const vector<Geometry*>& /*objs*/ ) const { return false; }
+	virtual bool read( const char*& /*data*/, const char* /*end*/, const vector<Geometry*>& /*objs*/ ) { return false; }
+
+	// Hand every object whose region the ray passes through between 0 and
+	// tMax to the visitor, each object at most once.
+	virtual void traverse( const ray& r, double tMax, AcceleratorVisitor& visitor ) const = 0;
+
+	// Find the closest intersection among the objects, through
+	// Geometry::intersect().
+	bool intersect( const ray& r, isect& i ) const;
+
+	// Same as intersect(), but for objects stored in the space of the ray,
+	// which are hit through Geometry::intersectLocal().
+	bool intersectLocal( const ray& r, isect& i ) const;
+
+	// Closest intersections of a packet of up to RAY_PACKET_SIZE rays, as
+	// for Geometry::intersectPacket().  Structures that can trace the rays
+	// together override tracePacket(); the others trace them one by one.
+	// If all the rays lie within frustum, it may be given for the parts of
+	// the structure outside it to be passed over.
+	void intersectPacket( int count, const ray* const* r, isect* const* i, const Frustum* frustum = NULL ) const;
+
+	// Same as intersectPacket(), for objects stored in the space of the rays.
+	void intersectPacketLocal( int count, const ray* const* r, isect* const* i ) const;
+
+	// Is any of the objects an opaque blocker of the ray before tMax?  The
+	// traversal stops at the first one found, through Geometry::occluded(),
+	// which is put in blocker if given.
+	bool occluded( const ray& r, double tMax, Geometry** blocker = NULL ) const;
+
+	// Same as occluded(), through Geometry::occludedLocal().
+	bool occludedLocal( const ray& r, double tMax ) const;
+
+	// Multiply atten by what each object lets through before tMax, through
+	// Geometry::attenuate().  Returns false, leaving atten partly
+	// multiplied, as soon as every component is at or below threshold; the
+	// object that took it there is then put in blocker if given.
+	bool attenuate( const ray& r, double tMax, double threshold, vec3f& atten, Geometry** blocker = NULL ) const;
+
+	// Same as attenuate(), through Geometry::attenuateLocal().
+	bool attenuateLocal( const ray& r, double tMax, double threshold, vec3f& atten ) const;
+
+protected:
+	virtual void tracePacket( int count, const ray* const* r, isect* const* i, bool local, const Frustum* frustum ) const;
+
+	// copy count plain values to the end of out, or back from data
+	template<typename T>
+	static void put( vector<char>& out, const T* v, size_t count )
+	{
+		const size_t at = out.size();
+		out.resize( at + sizeof(T) * count );
+		if( count > 0 ) memcpy( &out[at], v, sizeof(T) * count );
+	}
+
+	template<typename T>
+	static bool get( const char*& data, const char* end, T* v, size_t count )
+	{
+		if( (size_t)(end - data) < sizeof(T) * count ) return false;
+		if( count > 0 ) memcpy( (void*)v, data, sizeof(T) * count );
+		data += sizeof(T) * count;
+		return true;
+	}
+
+	// the same for a whole vector, preceded by its size
+	template<typename T>
+	static void putVector( vector<char>& out, const vector<T>& v )
+	{
+		const unsigned long long count = v.size();
+		put( out, &count, 1 );
+		put( out, v.empty() ? (const T*)NULL : &v[0], v.size() );
+	}
+
+	template<typename T>
+	static bool getVector( const char*& data, const char* end, vector<T>& v )
+	{
+		unsigned long long count;
+		if( !get( data, end, &count, 1 ) ) return false;
+		if( (unsigned long long)(end - data) / sizeof(T) < count ) return false;
+		v.resize( (size_t)count );
+		return get( data, end, v.empty() ? (T*)NULL : &v[0], v.size() );
+	}
+};
+
+
+#endif // __ACCELERATOR_H__
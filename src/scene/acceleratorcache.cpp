@@ -0,0 +1,218 @@
+#include <cstdio>
+#include <cstring>
+
+#include "acceleratorcache.h"
+
+
+// Static Data
+// the file starts with this, then the number of entries; each entry is its
+// key, its size and the structure as Accelerator::write() put it
+static const char		AcceleratorCache_magic[8]	= { 'R', 'A', 'Y', 'A', 'C', 'C', 'L', '1' };
+
+
+// Static Function Prototype
+static uint64_t AcceleratorCache_hash(uint64_t hash, const void* data, size_t size);
+static bool AcceleratorCache_read(const char*& data, const char* end, void* v, size_t size);
+
+
+// Operation Handling
+void AcceleratorCache::open( const string& path )
+{
+	this->path = path;
+	found.clear();
+	stored.clear();
+	used.clear();
+	changed = false;
+
+	// a missing or unreadable file is simply an empty cache
+	if( !file.open( path.c_str() ) )
+		return;
+
+	const char* data	= file.data();
+	const char* end		= data + file.size();
+
+	char		magic[8];
+	uint64_t	count;
+	if( !AcceleratorCache_read( data, end, magic, sizeof(magic) ) ||
+		memcmp( magic, AcceleratorCache_magic, sizeof(magic) ) != 0 ||
+		!AcceleratorCache_read( data, end, &count, sizeof(count) ) )
+		return;
+
+	for( uint64_t k = 0; k < count; ++k ) {
+		uint64_t key, size;
+		if( !AcceleratorCache_read( data, end, &key, sizeof(key) ) ||
+			!AcceleratorCache_read( data, end, &size, sizeof(size) ) ||
+			(uint64_t)(end - data) < size )
+			return;
+
+		Entry entry;
+		entry.data = data;
+		entry.size = (size_t)size;
+		found[key] = entry;
+		data += size;
+	}
+}
+
+
+bool AcceleratorCache::load( Accelerator& acc, const vector<Geometry*>& objs, bool local )
+{
+	return loadKey( acc, key( objs, local ), objs );
+}
+
+
+void AcceleratorCache::store( const Accelerator& acc, const vector<Geometry*>& objs, bool local )
+{
+	storeKey( acc, key( objs, local ), objs );
+}
+
+
+bool AcceleratorCache::load( Accelerator& acc, const vector<BoundingBox>& bounds )
+{
+	return loadKey( acc, key( bounds, 2 ), vector<Geometry*>() );
+}
+
+
+void AcceleratorCache::store( const Accelerator& acc, const vector<BoundingBox>& bounds )
+{
+	storeKey( acc, key( bounds, 2 ), vector<Geometry*>() );
+}
+
+
+bool AcceleratorCache::loadKey( Accelerator& acc, uint64_t k, const vector<Geometry*>& objs )
+{
+	map<uint64_t, Entry>::const_iterator entry = found.find( k );
+	if( entry == found.end() )
+		return false;
+
+	const char* data	= entry->second.data;
+	const char* end		= data + entry->second.size;
+	if( !acc.read( data, end, objs ) || data != end )
+		return false;
+
+	lock_guard<mutex> guard( lock );
+	used.insert( k );
+	return true;
+}
+
+
+void AcceleratorCache::storeKey( const Accelerator& acc, uint64_t k, const vector<Geometry*>& objs )
+{
+	vector<char> data;
+	if( !acc.write( data, objs ) )
+		return;
+
+	lock_guard<mutex> guard( lock );
+	stored[k].swap( data );
+	changed = true;
+}
+
+
+// The new file is written next to the old one and then takes its place, as
+// the old one is still mapped while the new one is written.
+void AcceleratorCache::save()
+{
+	if( !file.isOpen() && !changed )
+		return;
+	if( !changed && used.size() == found.size() ) {
+		file.close();
+		return;
+	}
+
+	const string temp = path + ".tmp";
+	FILE* out = fopen( temp.c_str(), "wb" );
+	if( out == NULL ) {
+		file.close();
+		return;
+	}
+
+	uint64_t count = stored.size();
+	for( set<uint64_t>::const_iterator k = used.begin(); k != used.end(); ++k ) {
+		if( stored.find( *k ) == stored.end() )
+			++count;
+	}
+
+	bool ok = fwrite( AcceleratorCache_magic, sizeof(AcceleratorCache_magic), 1, out ) == 1 &&
+		fwrite( &count, sizeof(count), 1, out ) == 1;
+
+	for( set<uint64_t>::const_iterator k = used.begin(); ok && k != used.end(); ++k ) {
+		if( stored.find( *k ) != stored.end() )
+			continue;
+
+		const Entry& entry = found[*k];
+		const uint64_t size = entry.size;
+		ok = fwrite( &*k, sizeof(uint64_t), 1, out ) == 1 &&
+			fwrite( &size, sizeof(size), 1, out ) == 1 &&
+			(size == 0 || fwrite( entry.data, (size_t)size, 1, out ) == 1);
+	}
+
+	for( map<uint64_t, vector<char> >::const_iterator k = stored.begin(); ok && k != stored.end(); ++k ) {
+		const uint64_t size = k->second.size();
+		ok = fwrite( &k->first, sizeof(uint64_t), 1, out ) == 1 &&
+			fwrite( &size, sizeof(size), 1, out ) == 1 &&
+			(size == 0 || fwrite( &k->second[0], (size_t)size, 1, out ) == 1);
+	}
+
+	ok = fclose( out ) == 0 && ok;
+
+	file.close();
+	found.clear();
+
+	if( ok ) {
+		remove( path.c_str() );
+		ok = rename( temp.c_str(), path.c_str() ) == 0;
+	}
+	if( !ok )
+		remove( temp.c_str() );
+
+	stored.clear();
+	used.clear();
+	changed = false;
+}
+
+
+uint64_t AcceleratorCache::key( const vector<Geometry*>& objs, bool local )
+{
+	vector<BoundingBox> bounds( objs.size() );
+	for( size_t k = 0; k < objs.size(); ++k ) {
+		bounds[k] = local ? objs[k]->ComputeLocalBoundingBox() : objs[k]->getBoundingBox();
+	}
+	return key( bounds, local ? 1 : 0 );
+}
+
+
+uint64_t AcceleratorCache::key( const vector<BoundingBox>& bounds, int kind )
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	const uint64_t header[2] = { (uint64_t)bounds.size(), (uint64_t)kind };
+	hash = AcceleratorCache_hash( hash, header, sizeof(header) );
+
+	for( size_t k = 0; k < bounds.size(); ++k ) {
+		const double v[6] = { bounds[k].min[0], bounds[k].min[1], bounds[k].min[2], bounds[k].max[0], bounds[k].max[1], bounds[k].max[2] };
+		hash = AcceleratorCache_hash( hash, v, sizeof(v) );
+	}
+
+	return hash;
+}
+
+
+// Static Function Implementation
+// 64-bit FNV-1a
+static uint64_t AcceleratorCache_hash(uint64_t hash, const void* data, size_t size)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	for( size_t k = 0; k < size; ++k ) {
+		hash ^= p[k];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+
+static bool AcceleratorCache_read(const char*& data, const char* end, void* v, size_t size)
+{
+	if( (size_t)(end - data) < size ) return false;
+	memcpy( v, data, size );
+	data += size;
+	return true;
+}
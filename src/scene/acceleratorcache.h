@@ -0,0 +1,78 @@
+//
+// acceleratorcache.h
+//
+// A file of built acceleration structures, so that a scene rendered again
+// does not build them again.  Each structure is stored under a key hashed
+// from all that its build depends on: the bounding boxes of its objects,
+// in order, and so the geometry and transforms of the scene.  The file is
+// memory-mapped, the structures are read from it as they are needed, and
+// it is only rewritten if some had to be built.
+//
+
+#ifndef __ACCELERATORCACHE_H__
+#define __ACCELERATORCACHE_H__
+
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "scene.h"
+#include "accelerator.h"
+#include "../fileio/mappedfile.h"
+
+
+class AcceleratorCache {
+public:
+	AcceleratorCache()
+		: path(), file(), found(), stored(), used(), changed( false ) {}
+
+	// use the cache file at path, which need not exist yet
+	void open( const string& path );
+
+	// Restore acc over objs, as built by build() or, if local, by
+	// buildLocal(); false if the file has no entry for it.  Objects may be
+	// restored from several threads at the same time.
+	bool load( Accelerator& acc, const vector<Geometry*>& objs, bool local );
+
+	// Add acc, just built over objs, to the file; a structure that cannot
+	// be saved is left out.
+	void store( const Accelerator& acc, const vector<Geometry*>& objs, bool local );
+
+	// The same for a structure over primitives with the given local
+	// bounds, as built by BVH::buildPrimitives().
+	bool load( Accelerator& acc, const vector<BoundingBox>& bounds );
+	void store( const Accelerator& acc, const vector<BoundingBox>& bounds );
+
+	// Write the file again if anything was stored, or if some of its
+	// entries were not used, and let go of it.
+	void save();
+
+private:
+	static uint64_t key( const vector<Geometry*>& objs, bool local );
+
+	// kind tells apart world and local objects and primitives
+	static uint64_t key( const vector<BoundingBox>& bounds, int kind );
+
+	bool loadKey( Accelerator& acc, uint64_t k, const vector<Geometry*>& objs );
+	void storeKey( const Accelerator& acc, uint64_t k, const vector<Geometry*>& objs );
+
+	struct Entry {
+		const char*	data;			// in the mapped file
+		size_t		size;
+	};
+
+	string							path;
+	MappedFile						file;
+	map<uint64_t, Entry>			found;
+	map<uint64_t, vector<char> >	stored;
+	set<uint64_t>					used;
+	mutex							lock;
+	bool							changed;
+};
+
+
+#endif // __ACCELERATORCACHE_H__
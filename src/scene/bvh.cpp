@@ -0,0 +1,925 @@
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+
+#include "bvh.h"
+#include "tasks.h"
+
+
+// Static Data
+// relative cost of visiting an interior node, compared with intersecting
+// one object (whose cost is 1.0)
+static const double SAH_COST_TRAVERSAL = 0.125;
+
+const double BVH::REBUILD_COST_RATIO = 1.5;
+const double BVH::SPATIAL_SPLIT_MIN_OVERLAP = 1.0e-5;
+const double BVH::SPATIAL_SPLIT_MAX_DUPLICATES = 0.5;
+
+
+// Static Function Prototype
+static int BVH_spatialBin(double x, const BoundingBox& bounds, int axis, int bins);
+static double BVH_spatialPlane(int b, const BoundingBox& bounds, int axis, int bins);
+static BoundingBox BVH_clip(const BoundingBox& box, int axis, double lo, double hi);
+static double BVH_leafCost(int count, int leaf_width);
+
+
+// Operation Handling
+void BVH::clear()
+{
+	nodes.clear();
+	objects.clear();
+	duplicated.clear();
+	primitives.clear();
+	build_cost = 0.0;
+}
+
+
+void BVH::build( const list<Geometry*>& objs, const BoundingBox& /*bounds*/ )
+{
+	clear();
+	if (objs.empty()) return;
+
+	local = false;
+
+	vector<BuildEntry> entries;
+	entries.reserve(objs.size());
+
+	for (list<Geometry*>::const_iterator j = objs.begin(); j != objs.end(); ++j) {
+		BuildEntry entry;
+		entry.obj		= *j;
+		entry.bounds	= (*j)->getBoundingBox();
+		entry.centroid	= (entry.bounds.min + entry.bounds.max) * 0.5;
+		entries.push_back(entry);
+	}
+
+	buildEntries(entries);
+}
+
+
+void BVH::buildLocal( const vector<Geometry*>& objs )
+{
+	clear();
+	if (objs.empty()) return;
+
+	local = true;
+
+	vector<BuildEntry> entries;
+	entries.reserve(objs.size());
+
+	for (vector<Geometry*>::const_iterator j = objs.begin(); j != objs.end(); ++j) {
+		BuildEntry entry;
+		entry.obj		= *j;
+		entry.bounds	= (*j)->ComputeLocalBoundingBox();
+		entry.centroid	= (entry.bounds.min + entry.bounds.max) * 0.5;
+		entries.push_back(entry);
+	}
+
+	buildEntries(entries);
+}
+
+
+void BVH::buildPrimitives( const vector<BoundingBox>& bounds )
+{
+	clear();
+	if (bounds.empty()) return;
+
+	local = true;
+
+	vector<BuildEntry> entries(bounds.size());
+	for (size_t k = 0; k < bounds.size(); ++k) {
+		BuildEntry& entry = entries[k];
+		entry.obj		= NULL;
+		entry.primitive	= (int)k;
+		entry.bounds	= bounds[k];
+		entry.centroid	= (entry.bounds.min + entry.bounds.max) * 0.5;
+	}
+
+	nodes.reserve(2 * entries.size() - 1);
+	buildRecursive(entries, 0, (int)entries.size(), 0, leaf_width, nodes);
+
+	primitives.reserve(entries.size());
+	for (size_t k = 0; k < entries.size(); ++k) {
+		primitives.push_back(entries[k].primitive);
+	}
+
+	build_cost = cost();
+}
+
+
+void BVH::buildEntries( vector<BuildEntry>& entries )
+{
+	if (spatial_splits) {
+		BoundingBox root = entries[0].bounds;
+		for (size_t k = 1; k < entries.size(); ++k) {
+			root.merge(entries[k].bounds);
+		}
+
+		const int budget_max = (int)(entries.size() * SPATIAL_SPLIT_MAX_DUPLICATES);
+		int budget = budget_max;
+		buildSpatial(entries, 0, root.area(), budget, nodes);
+
+		// flag the objects that more than one leaf refers to
+		if (budget < budget_max) {
+			vector<Geometry*> sorted(objects);
+			sort(sorted.begin(), sorted.end());
+
+			vector<Geometry*> shared;
+			for (size_t k = 1; k < sorted.size(); ++k) {
+				if (sorted[k] == sorted[k - 1] && (shared.empty() || shared.back() != sorted[k]))
+					shared.push_back(sorted[k]);
+			}
+
+			duplicated.resize(objects.size());
+			for (size_t k = 0; k < objects.size(); ++k) {
+				duplicated[k] = binary_search(shared.begin(), shared.end(), objects[k]);
+			}
+		}
+
+		// refit() grows the clipped leaves back to whole objects, so the
+		// cost it is held to is taken from the same bounds
+		vector<Node> clipped(nodes);
+		refitBounds();
+		build_cost = cost();
+		nodes.swap(clipped);
+		return;
+	}
+
+	// a binary tree never has more than 2n - 1 nodes
+	nodes.reserve(2 * entries.size() - 1);
+	buildRecursive(entries, 0, (int)entries.size(), 0, leaf_width, nodes);
+
+	// the leaves index into the object array in the order the build left them
+	objects.reserve(entries.size());
+	for (size_t k = 0; k < entries.size(); ++k) {
+		objects.push_back(entries[k].obj);
+	}
+
+	build_cost = cost();
+}
+
+
+// The nodes are written as they are in memory; the header records their
+// size, and the build options that change the tree.  A tree over
+// primitives keeps their order in place of the objects.
+bool BVH::write( vector<char>& out, const vector<Geometry*>& objs ) const
+{
+	const int kind = !primitives.empty() ? 2 : local ? 1 : 0;
+	const int header[5] = { 'B' | 'V' << 8 | 'H' << 16, (int)sizeof(Node), kind, spatial_splits ? 1 : 0, leaf_width };
+	put(out, header, 5);
+	put(out, &build_cost, 1);
+	putVector(out, nodes);
+
+	if (kind == 2) {
+		putVector(out, primitives);
+		vector<char> flags;
+		putVector(out, flags);
+		return true;
+	}
+
+	unordered_map<Geometry*, int> index;
+	for (size_t k = 0; k < objs.size(); ++k) {
+		index[objs[k]] = (int)k;
+	}
+
+	vector<int> refs(objects.size());
+	for (size_t k = 0; k < objects.size(); ++k) {
+		unordered_map<Geometry*, int>::const_iterator found = index.find(objects[k]);
+		if (found == index.end()) return false;
+		refs[k] = found->second;
+	}
+	putVector(out, refs);
+
+	vector<char> flags(duplicated.begin(), duplicated.end());
+	putVector(out, flags);
+	return true;
+}
+
+
+bool BVH::read( const char*& data, const char* end, const vector<Geometry*>& objs )
+{
+	clear();
+
+	int header[5];
+	if (!get(data, end, header, 5)) return false;
+	if (header[0] != ('B' | 'V' << 8 | 'H' << 16) || header[1] != (int)sizeof(Node) || header[3] != (spatial_splits ? 1 : 0) ||
+		header[4] != leaf_width)
+		return false;
+	local = header[2] != 0;
+	if ((header[2] == 2) != (primitive_owner != NULL)) return false;
+
+	if (!get(data, end, &build_cost, 1)) return false;
+	if (!getVector(data, end, nodes)) return false;
+
+	vector<int> refs;
+	if (!getVector(data, end, refs)) return false;
+	if (header[2] == 2) {
+		primitives.swap(refs);
+		vector<char> flags;
+		return getVector(data, end, flags) && flags.empty() && checkTree();
+	}
+	objects.resize(refs.size());
+	for (size_t k = 0; k < refs.size(); ++k) {
+		if (refs[k] < 0 || refs[k] >= (int)objs.size()) return false;
+		objects[k] = objs[refs[k]];
+	}
+
+	vector<char> flags;
+	if (!getVector(data, end, flags)) return false;
+	if (!flags.empty() && flags.size() != objects.size()) return false;
+	duplicated.assign(flags.begin(), flags.end());
+	return checkTree();
+}
+
+
+bool BVH::checkTree() const
+{
+	const int items = numItems();
+	const int count = (int)nodes.size();
+	vector<int> depth(count, 0);
+	vector<bool> covered(items, false);
+
+	for (int n = 0; n < count; ++n) {
+		const Node& node = nodes[n];
+		if (node.count < 0 || depth[n] >= MAX_DEPTH) return false;
+
+		// the leaves do not overlap, which the faces of a mesh rely on
+		if (node.count > 0) {
+			if (node.offset < 0 || node.offset > items - node.count) return false;
+			for (int k = node.offset; k < node.offset + node.count; ++k) {
+				if (covered[k]) return false;
+				covered[k] = true;
+			}
+			continue;
+		}
+
+		if (node.offset <= n + 1 || node.offset >= count) return false;
+		depth[n + 1]		= max(depth[n + 1], depth[n] + 1);
+		depth[node.offset]	= max(depth[node.offset], depth[n] + 1);
+	}
+
+	vector<bool> seen(primitives.size(), false);
+	for (size_t k = 0; k < primitives.size(); ++k) {
+		const int p = primitives[k];
+		if (p < 0 || p >= (int)primitives.size() || seen[p]) return false;
+		seen[p] = true;
+	}
+	return true;
+}
+
+
+BoundingBox BVH::objectBounds( Geometry* obj ) const
+{
+	if (local) return obj->ComputeLocalBoundingBox();
+	return obj->getBoundingBox();
+}
+
+
+bool BVH::refit()
+{
+	// the bounds of primitives are only known to their owner
+	if (!primitives.empty()) return false;
+	if (nodes.empty()) return true;
+
+	refitBounds();
+	return refitCostOK(cost());
+}
+
+
+// The children of a node always come after it, so walking the array
+// backwards updates them before their parent.
+void BVH::refitBounds()
+{
+	for (int n = (int)nodes.size() - 1; n >= 0; --n) {
+		Node& node = nodes[n];
+
+		if (node.count > 0) {
+			node.bounds = objectBounds(objects[node.offset]);
+			for (int k = node.offset + 1; k < node.offset + node.count; ++k) {
+				node.bounds.merge(objectBounds(objects[k]));
+			}
+		} else {
+			node.bounds = nodes[n + 1].bounds;
+			node.bounds.merge(nodes[node.offset].bounds);
+		}
+	}
+}
+
+
+double BVH::cost() const
+{
+	if (nodes.empty()) return 0.0;
+
+	double sum = 0.0;
+	for (size_t n = 0; n < nodes.size(); ++n) {
+		sum += nodeCost(nodes[n].bounds.area(), nodes[n].count);
+	}
+
+	// a flat scene has no area to compare against
+	const double root_area = nodes[0].bounds.area();
+	return root_area > 0.0 ? sum / root_area : sum;
+}
+
+
+double BVH::nodeCost( double area, int count )
+{
+	return area * (count > 0 ? (double)count : SAH_COST_TRAVERSAL);
+}
+
+
+bool BVH::refitCostOK( double cost ) const
+{
+	return cost <= build_cost * REBUILD_COST_RATIO;
+}
+
+
+void BVH::buildRecursive( vector<BuildEntry>& entries, int begin, int end, int depth, int leaf_width, vector<Node>& out )
+{
+	const int index = (int)out.size();
+	out.push_back(Node());
+
+	BoundingBox bounds = entries[begin].bounds;
+	for (int k = begin + 1; k < end; ++k) {
+		bounds.merge(entries[k].bounds);
+	}
+	out[index].bounds = bounds;
+
+	const int middle = split(entries, begin, end, depth, bounds, leaf_width);
+	if (middle < 0) {
+		out[index].offset = begin;
+		out[index].count = end - begin;
+		return;
+	}
+
+	out[index].count = 0;
+
+	// small enough: build both children right here
+	if (end - begin < PARALLEL_MIN_OBJECTS) {
+		buildRecursive(entries, begin, middle, depth + 1, leaf_width, out);
+		out[index].offset = (int)out.size();
+		buildRecursive(entries, middle, end, depth + 1, leaf_width, out);
+		return;
+	}
+
+	// otherwise build the first child as a task and the second one
+	// meanwhile, each into a node array of its own, and append both; their
+	// halves of entries do not overlap
+	vector<Node> first, second;
+
+	TaskGroup group;
+	group.run([&]() { buildRecursive(entries, begin, middle, depth + 1, leaf_width, first); });
+	buildRecursive(entries, middle, end, depth + 1, leaf_width, second);
+	group.wait();
+
+	const int base_first = index + 1;
+	const int base_second = base_first + (int)first.size();
+	out[index].offset = base_second;
+
+	out.reserve(out.size() + first.size() + second.size());
+	for (size_t k = 0; k < first.size(); ++k) {
+		out.push_back(first[k]);
+		if (first[k].count == 0) out.back().offset += base_first;
+	}
+	for (size_t k = 0; k < second.size(); ++k) {
+		out.push_back(second[k]);
+		if (second[k].count == 0) out.back().offset += base_second;
+	}
+}
+
+
+// The spatial build runs on a single thread: every node has a list of
+// entries of its own, as the two children of a spatial split share some.
+void BVH::buildSpatial( vector<BuildEntry>& entries, int depth, double root_area, int& budget, vector<Node>& out )
+{
+	const int index = (int)out.size();
+	out.push_back(Node());
+
+	const int count = (int)entries.size();
+	BoundingBox bounds = entries[0].bounds;
+	for (int k = 1; k < count; ++k) {
+		bounds.merge(entries[k].bounds);
+	}
+	out[index].bounds = bounds;
+
+	vector<BuildEntry> left, right;
+	bool spatial = false;
+
+	if (count > 1 && depth < MAX_DEPTH - 1) {
+		double object_cost = 1.0e308;
+		const int middle = split(entries, 0, count, depth, bounds, leaf_width, &object_cost);
+
+		// a leaf or a split by count is as bad as overlap gets
+		double overlap = bounds.area();
+		if (middle >= 0 && object_cost < 1.0e308) {
+			BoundingBox first = entries[0].bounds;
+			for (int k = 1; k < middle; ++k) {
+				first.merge(entries[k].bounds);
+			}
+			BoundingBox second = entries[middle].bounds;
+			for (int k = middle + 1; k < count; ++k) {
+				second.merge(entries[k].bounds);
+			}
+
+			BoundingBox common;
+			common.min = maximum(first.min, second.min);
+			common.max = minimum(first.max, second.max);
+			const vec3f d = common.max - common.min;
+			overlap = (d[0] >= 0.0 && d[1] >= 0.0 && d[2] >= 0.0) ? common.area() : 0.0;
+		}
+
+		if (budget > 0 && root_area > 0.0 && overlap / root_area > SPATIAL_SPLIT_MIN_OVERLAP) {
+			const double cost_limit = middle >= 0 ? object_cost : (double)count;
+			spatial = spatialSplit(entries, bounds, cost_limit, budget, left, right);
+		}
+
+		if (!spatial && middle >= 0) {
+			left.assign(entries.begin(), entries.begin() + middle);
+			right.assign(entries.begin() + middle, entries.end());
+		}
+	}
+
+	if (left.empty()) {
+		out[index].offset = (int)objects.size();
+		out[index].count = count;
+		for (int k = 0; k < count; ++k) {
+			objects.push_back(entries[k].obj);
+		}
+		return;
+	}
+
+	vector<BuildEntry>().swap(entries);
+
+	out[index].count = 0;
+	buildSpatial(left, depth + 1, root_area, budget, out);
+	out[index].offset = (int)out.size();
+	buildSpatial(right, depth + 1, root_area, budget, out);
+}
+
+
+// The bins span the node's bounds, and every entry is clipped to each of
+// the bins it overlaps.  An entry enters the left side of the plane between
+// bins b - 1 and b if it starts before bin b, and the right one if it ends
+// in bin b or after.
+bool BVH::spatialSplit( const vector<BuildEntry>& entries, const BoundingBox& bounds, double cost_limit, int& budget,
+	vector<BuildEntry>& left, vector<BuildEntry>& right ) const
+{
+	const int count = (int)entries.size();
+	const double area_parent = bounds.area();
+	if (area_parent <= 0.0) return false;
+
+	double	cost_best	= cost_limit;
+	int		axis_best	= -1;
+	int		split_best	= -1;
+
+	for (int axis = 0; axis < 3; ++axis) {
+		if (bounds.max[axis] <= bounds.min[axis]) continue;
+
+		int			enter[NUM_BINS]		= { 0 };
+		int			leave[NUM_BINS]		= { 0 };
+		bool		used[NUM_BINS]		= { false };
+		BoundingBox	bin_bounds[NUM_BINS];
+		for (int k = 0; k < count; ++k) {
+			const BoundingBox& box = entries[k].bounds;
+			const int first	= BVH_spatialBin(box.min[axis], bounds, axis, NUM_BINS);
+			const int last	= BVH_spatialBin(box.max[axis], bounds, axis, NUM_BINS);
+			++enter[first];
+			++leave[last];
+
+			for (int b = first; b <= last; ++b) {
+				const BoundingBox clipped = clipEntry(entries[k], axis,
+					BVH_spatialPlane(b, bounds, axis, NUM_BINS), BVH_spatialPlane(b + 1, bounds, axis, NUM_BINS));
+				if (!used[b])	bin_bounds[b] = clipped;
+				else			bin_bounds[b].merge(clipped);
+				used[b] = true;
+			}
+		}
+
+		// right side: area and count of bins b .. NUM_BINS - 1
+		double		area_right[NUM_BINS];
+		int			count_right[NUM_BINS];
+		BoundingBox	box;
+		bool		have_box = false;
+		int			n = 0;
+		for (int b = NUM_BINS - 1; b > 0; --b) {
+			if (used[b]) {
+				if (!have_box)	box = bin_bounds[b];
+				else			box.merge(bin_bounds[b]);
+				have_box = true;
+			}
+			n += leave[b];
+			area_right[b]	= have_box ? box.area() : 0.0;
+			count_right[b]	= n;
+		}
+
+		have_box = false;
+		n = 0;
+		for (int b = 1; b < NUM_BINS; ++b) {
+			// split between bin b - 1 and bin b
+			if (used[b - 1]) {
+				if (!have_box)	box = bin_bounds[b - 1];
+				else			box.merge(bin_bounds[b - 1]);
+				have_box = true;
+			}
+			n += enter[b - 1];
+			if (n == 0 || count_right[b] == 0) continue;
+			if (n + count_right[b] - count > budget) continue;
+
+			const double cost = SAH_COST_TRAVERSAL +
+				(n * box.area() + count_right[b] * area_right[b]) / area_parent;
+
+			if (cost < cost_best) {
+				cost_best	= cost;
+				axis_best	= axis;
+				split_best	= b;
+			}
+		}
+	}
+
+	if (axis_best < 0) return false;
+
+	const int		axis	= axis_best;
+	const double	plane	= BVH_spatialPlane(split_best, bounds, axis, NUM_BINS);
+
+	for (int k = 0; k < count; ++k) {
+		const BuildEntry& entry = entries[k];
+		const int first	= BVH_spatialBin(entry.bounds.min[axis], bounds, axis, NUM_BINS);
+		const int last	= BVH_spatialBin(entry.bounds.max[axis], bounds, axis, NUM_BINS);
+
+		if (last < split_best) {
+			left.push_back(entry);
+		} else if (first >= split_best) {
+			right.push_back(entry);
+		} else {
+			// straddling: a reference on each side, clipped to it
+			BuildEntry part = entry;
+			part.bounds		= clipEntry(entry, axis, bounds.min[axis], plane);
+			part.centroid	= (part.bounds.min + part.bounds.max) * 0.5;
+			left.push_back(part);
+
+			part.bounds		= clipEntry(entry, axis, plane, bounds.max[axis]);
+			part.centroid	= (part.bounds.min + part.bounds.max) * 0.5;
+			right.push_back(part);
+		}
+	}
+
+	budget -= (int)(left.size() + right.size()) - count;
+	return true;
+}
+
+
+// The entry's box is cut first; in world space the object can narrow that
+// down further, since both bound the same part of it.
+BoundingBox BVH::clipEntry( const BuildEntry& entry, int axis, double lo, double hi ) const
+{
+	const BoundingBox clipped = BVH_clip(entry.bounds, axis, lo, hi);
+	if (local) return clipped;
+
+	const BoundingBox part = entry.obj->ComputeClippedBoundingBox(axis, lo, hi);
+
+	BoundingBox both;
+	both.min = maximum(clipped.min, part.min);
+	both.max = minimum(clipped.max, part.max);
+	for (int k = 0; k < 3; ++k) {
+		if (both.min[k] > both.max[k]) return clipped;
+	}
+	return both;
+}
+
+
+// Bin the centroids along each axis and evaluate the SAH between every two
+// neighbouring bins, using the areas of the boxes growing in from both ends.
+// The cost of the split chosen, if any, goes to split_cost.
+int BVH::split( vector<BuildEntry>& entries, int begin, int end, int depth, const BoundingBox& bounds, int leaf_width, double* split_cost )
+{
+	const int count = end - begin;
+
+	// a leaf costs one intersection per leaf_width objects it holds
+	if (count <= 1 || depth >= MAX_DEPTH - 1) return -1;
+
+	BoundingBox centroids;
+	centroids.min = centroids.max = entries[begin].centroid;
+	for (int k = begin + 1; k < end; ++k) {
+		centroids.min = minimum(centroids.min, entries[k].centroid);
+		centroids.max = maximum(centroids.max, entries[k].centroid);
+	}
+
+	const double area_parent = bounds.area();
+
+	double		cost_best	= 1.0e308;
+	BinIndex	bin_best;
+	int			split_best	= -1;
+
+	for (int axis = 0; axis < 3; ++axis) {
+		const double extent = centroids.max[axis] - centroids.min[axis];
+		if (extent <= 0.0) continue;
+
+		BinIndex bin_index;
+		bin_index.axis		= axis;
+		bin_index.origin	= centroids.min[axis];
+		bin_index.scale		= NUM_BINS / extent;
+
+		int			bin_count[NUM_BINS]		= { 0 };
+		BoundingBox	bin_bounds[NUM_BINS];
+		for (int k = begin; k < end; ++k) {
+			const int b = bin_index(entries[k]);
+			if (bin_count[b]++ == 0)	bin_bounds[b] = entries[k].bounds;
+			else						bin_bounds[b].merge(entries[k].bounds);
+		}
+
+		// right side: area and count of bins b .. NUM_BINS - 1
+		double		area_right[NUM_BINS];
+		int			count_right[NUM_BINS];
+		BoundingBox	box;
+		int			n = 0;
+		for (int b = NUM_BINS - 1; b > 0; --b) {
+			if (bin_count[b] > 0) {
+				if (n == 0)	box = bin_bounds[b];
+				else		box.merge(bin_bounds[b]);
+				n += bin_count[b];
+			}
+			area_right[b]	= n > 0 ? box.area() : 0.0;
+			count_right[b]	= n;
+		}
+
+		n = 0;
+		for (int b = 1; b < NUM_BINS; ++b) {
+			// split between bin b - 1 and bin b
+			if (bin_count[b - 1] > 0) {
+				if (n == 0)	box = bin_bounds[b - 1];
+				else		box.merge(bin_bounds[b - 1]);
+				n += bin_count[b - 1];
+			}
+			if (n == 0 || count_right[b] == 0) continue;
+
+			const double cost = SAH_COST_TRAVERSAL +
+				(BVH_leafCost(n, leaf_width) * box.area() + BVH_leafCost(count_right[b], leaf_width) * area_right[b]) / area_parent;
+
+			if (cost < cost_best) {
+				cost_best	= cost;
+				bin_best	= bin_index;
+				split_best	= b;
+			}
+		}
+	}
+
+	// splitting does not pay off, keep the objects together
+	if (count <= MAX_LEAF_SIZE && cost_best >= BVH_leafCost(count, leaf_width)) return -1;
+
+	// coincident centroids or degenerate boxes (zero parent area) give no
+	// usable cost, split by count
+	if (split_best < 0) return begin + count / 2;
+
+	if (split_cost != NULL) *split_cost = cost_best;
+
+	const BinIndex& bin_index = bin_best;
+	const int b = split_best;
+	BuildEntry* middle = partition(&entries[0] + begin, &entries[0] + end,
+		[&](const BuildEntry& e) { return bin_index(e) < b; });
+	return (int)(middle - &entries[0]);
+}
+
+
+// Both children of an interior node are tested and the nearer one is
+// visited first; a node is skipped as soon as the ray enters it beyond the
+// current tMax, which the visitor lowers as it finds hits.
+void BVH::traverse( const ray& r, double tMax, AcceleratorVisitor& visitor ) const
+{
+	if (nodes.empty()) return;
+
+	double t_min, t_exit;
+	if (!nodes[0].bounds.intersect(r, t_min, t_exit)) return;
+
+	traverseFrom(0, t_min, r, tMax, visitor);
+}
+
+
+void BVH::traverseFrom( int index, double t, const ray& r, double tMax, AcceleratorVisitor& visitor ) const
+{
+	int		stack_node[MAX_DEPTH * 2];
+	double	stack_t[MAX_DEPTH * 2];
+	int		top = 0;
+	double	t_exit;
+
+	VisitedSet visited;
+
+	stack_node[top] = index;
+	stack_t[top] = t;
+	++top;
+
+	while (top > 0) {
+		--top;
+		if (stack_t[top] > tMax) continue;
+
+		const int index = stack_node[top];
+		const Node& node = nodes[index];
+
+		// leaf: hand the objects to the visitor
+		if (node.count > 0) {
+			if (!primitives.empty()) {
+				if (!visitor.visitPrimitives(*primitive_owner, node.offset, node.count, r, tMax)) return;
+				continue;
+			}
+			for (int k = node.offset; k < node.offset + node.count; ++k) {
+				if (!firstVisit(k, visited)) continue;
+				if (!visitor.visit(objects[k], r, tMax)) return;
+			}
+			continue;
+		}
+
+		// interior: order the children by entry distance
+		double t_first, t_second;
+		const bool hit_first	= nodes[index + 1].bounds.intersect(r, t_first, t_exit);
+		const bool hit_second	= nodes[node.offset].bounds.intersect(r, t_second, t_exit);
+
+		if (hit_first && hit_second) {
+			// push the far child first so that the near one is popped next
+			if (t_first <= t_second) {
+				stack_node[top] = node.offset;	stack_t[top] = t_second;	++top;
+				stack_node[top] = index + 1;	stack_t[top] = t_first;		++top;
+			} else {
+				stack_node[top] = index + 1;	stack_t[top] = t_first;		++top;
+				stack_node[top] = node.offset;	stack_t[top] = t_second;	++top;
+			}
+		} else if (hit_first) {
+			stack_node[top] = index + 1;		stack_t[top] = t_first;		++top;
+		} else if (hit_second) {
+			stack_node[top] = node.offset;		stack_t[top] = t_second;	++top;
+		}
+	}
+}
+
+
+// The children of a node are tested against the rays of the packet that
+// reached it, and pushed far to near with the rays that enter them, as in
+// the single-ray traversal.  One test against the frustum spares a child
+// the tests of all the rays when it lies outside.
+void BVH::tracePacket( int count, const ray* const* r, isect* const* i, bool local, const Frustum* frustum ) const
+{
+	if (nodes.empty()) return;
+
+	struct PacketEntry {
+		int			index;
+		double		t;				// the nearest entry of its rays
+		uint64_t	rays;			// bit k is set if ray k goes in
+	};
+
+	PacketEntry	stack[MAX_DEPTH * 2];
+	int			top = 0;
+
+	const uint64_t all = count < 64 ? (((uint64_t)1 << count) - 1) : ~(uint64_t)0;
+	stack[top].index	= 0;
+	stack[top].rays		= intersectBox(nodes[0].bounds, all, count, r, i, frustum, stack[top].t);
+	if (stack[top].rays == 0) return;
+	++top;
+
+	const ray*	sub_r[RAY_PACKET_SIZE];
+	isect*		sub_i[RAY_PACKET_SIZE];
+
+	while (top > 0) {
+		const PacketEntry packet = stack[--top];
+		const Node& node = nodes[packet.index];
+
+		int num_rays = 0;
+		for (uint64_t rays = packet.rays; rays != 0; rays &= rays - 1) {
+			++num_rays;
+		}
+
+		// diverged: finish the subtree one ray at a time
+		if (num_rays < PACKET_MIN_RAYS) {
+			for (int k = 0; k < count; ++k) {
+				if (!(packet.rays & ((uint64_t)1 << k))) continue;
+
+				ClosestHitVisitor visitor(*i[k], local);
+				traverseFrom(packet.index, packet.t, *r[k], i[k]->obj != NULL ? i[k]->t : 1.0e308, visitor);
+			}
+			continue;
+		}
+
+		// leaf: intersect the objects with all the rays at once
+		if (node.count > 0) {
+			int n = 0;
+			for (int k = 0; k < count; ++k) {
+				if (!(packet.rays & ((uint64_t)1 << k))) continue;
+				sub_r[n] = r[k];
+				sub_i[n] = i[k];
+				++n;
+			}
+
+			intersectLeaf(node.offset, node.count, n, sub_r, sub_i, local);
+			continue;
+		}
+
+		// interior: push the far child first so that the near one is
+		// popped next
+		PacketEntry near_child, far_child;
+		near_child.index	= packet.index + 1;
+		near_child.rays		= intersectBox(nodes[near_child.index].bounds, packet.rays, count, r, i, frustum, near_child.t);
+		far_child.index		= node.offset;
+		far_child.rays		= intersectBox(nodes[far_child.index].bounds, packet.rays, count, r, i, frustum, far_child.t);
+		if (far_child.t < near_child.t) swap(near_child, far_child);
+
+		if (far_child.rays != 0)	stack[top++] = far_child;
+		if (near_child.rays != 0)	stack[top++] = near_child;
+	}
+}
+
+
+uint64_t BVH::intersectBox( const BoundingBox& box, uint64_t rays, int count, const ray* const* r, isect* const* i,
+	const Frustum* frustum, double& t )
+{
+	uint64_t hits = 0;
+	t = 1.0e308;
+	if (frustum != NULL && !frustum->overlaps(box.min, box.max)) return hits;
+
+	for (int k = 0; k < count; ++k) {
+		if (!(rays & ((uint64_t)1 << k))) continue;
+
+		double t_enter, t_exit;
+		if (!box.intersect(*r[k], t_enter, t_exit)) continue;
+		if (i[k]->obj != NULL && t_enter > i[k]->t) continue;
+
+		hits |= (uint64_t)1 << k;
+		t = min(t, t_enter);
+	}
+	return hits;
+}
+
+
+void BVH::intersectLeaf( int first, int count, int n, const ray* const* r, isect* const* i, bool local ) const
+{
+	if (!primitives.empty()) {
+		for (int k = 0; k < n; ++k) {
+			isect cur;
+			const double tMax = i[k]->obj != NULL ? i[k]->t : 1.0e308;
+			if (primitive_owner->intersectPrimitives(first, count, *r[k], tMax, cur))
+				*i[k] = cur;
+		}
+		return;
+	}
+
+	for (int o = first; o < first + count; ++o) {
+		if (!local) {
+			objects[o]->intersectPacket(n, r, i);
+			continue;
+		}
+
+		for (int k = 0; k < n; ++k) {
+			isect cur;
+			if (objects[o]->intersectLocal(*r[k], cur) && (i[k]->obj == NULL || cur.t < i[k]->t))
+				*i[k] = cur;
+		}
+	}
+}
+
+
+bool BVH::VisitedSet::insert( Geometry* obj )
+{
+	for (int k = 0; k < count; ++k) {
+		if (first[k] == obj) return false;
+	}
+	for (size_t k = 0; k < more.size(); ++k) {
+		if (more[k] == obj) return false;
+	}
+
+	if (count < (int)(sizeof(first) / sizeof(first[0])))	first[count++] = obj;
+	else													more.push_back(obj);
+	return true;
+}
+
+
+// Static Function Implementation
+// the bin of the coordinate x, when bounds are cut into equal bins along
+// axis; clamped to the bins
+static int BVH_spatialBin(double x, const BoundingBox& bounds, int axis, int bins)
+{
+	const double scale = bins / (bounds.max[axis] - bounds.min[axis]);
+	return std::max(0, std::min((int)((x - bounds.min[axis]) * scale), bins - 1));
+}
+
+
+// the plane before bin b; the outer ones are the bounds themselves, so that
+// clipping to all the bins loses nothing
+static double BVH_spatialPlane(int b, const BoundingBox& bounds, int axis, int bins)
+{
+	if (b <= 0) return bounds.min[axis];
+	if (b >= bins) return bounds.max[axis];
+	return bounds.min[axis] + (bounds.max[axis] - bounds.min[axis]) * b / bins;
+}
+
+
+// the box cut down to lo .. hi along axis
+static BoundingBox BVH_clip(const BoundingBox& box, int axis, double lo, double hi)
+{
+	BoundingBox clipped = box;
+	clipped.min[axis] = std::min(std::max(box.min[axis], lo), hi);
+	clipped.max[axis] = std::min(std::max(box.max[axis], lo), hi);
+	return clipped;
+}
+
+
+
+// intersections a leaf of count objects takes, leaf_width at a time
+static double BVH_leafCost(int count, int leaf_width)
+{
+	return (double)((count + leaf_width - 1) / leaf_width);
+}
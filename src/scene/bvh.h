@@ -0,0 +1,246 @@
+//
+// bvh.h
+//
+// A bounding volume hierarchy over the bounded objects of a scene.  The
+// tree is built top-down with the surface area heuristic (SAH) and is
+// traversed front-to-back, so a ray only visits the few objects whose
+// bounding boxes it actually passes through.
+//
+// The SAH is evaluated over a fixed number of bins along each axis rather
+// than at every object, and the subtrees of large nodes are built in
+// parallel as tasks (see tasks.h).
+//
+// With spatial splits enabled (the "sbvh" accelerator), a node whose
+// children would overlap a lot may instead be cut by a plane, with the
+// objects straddling it referenced from both sides, each clipped to its
+// side.  This suits long, thin or overlapping objects, whose boxes no
+// split of the object list can keep apart.  The duplication is capped, and
+// the traversal hands an object referenced twice to the visitor only once.
+//
+// The same structure is used at two levels: the scene builds one over its
+// objects in world space, and every Trimesh builds one over its faces in
+// the mesh's local space, so that a ray is transformed once per mesh it
+// enters rather than once per triangle.  The triangles are no objects of
+// their own there: the tree is built over their bounds alone, and its
+// leaves hand ranges of them back to the mesh (see PrimitiveIntersector).
+//
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+
+#include <list>
+#include <vector>
+#include <cstdint>
+
+#include "scene.h"
+#include "accelerator.h"
+
+
+class BVH: public Accelerator {
+public:
+	BVH()
+		: nodes(), objects(), duplicated(), primitives(), primitive_owner( NULL ), local( false ), spatial_splits( false ), leaf_width( 1 ), build_cost( 0.0 ) {}
+
+	// Build the hierarchy over the given objects, using the world-space
+	// bounding boxes that Geometry::ComputeBoundingBox() already computed.
+	virtual void build( const list<Geometry*>& objs, const BoundingBox& bounds );
+
+	// Build the hierarchy over objects that all share one transform, using
+	// their local bounding boxes.  Rays must then be given in that local
+	// space too, and the objects hit through intersectLocal().
+	void buildLocal( const vector<Geometry*>& objs );
+
+	// Build the hierarchy over the primitives of the owner set with
+	// setPrimitiveIntersector(), given by their local bounding boxes; the
+	// leaves then hand ranges of getPrimitiveOrder() to it.  Spatial
+	// splits are not used for primitives.
+	void buildPrimitives( const vector<BoundingBox>& bounds );
+
+	// takes effect at the next build or read(), and must stay alive as
+	// long as the structure is used
+	void setPrimitiveIntersector( const PrimitiveIntersector* owner ) { primitive_owner = owner; }
+
+	// The primitives as the leaves refer to them: position k is the index
+	// into the bounds given to buildPrimitives().
+	const vector<int>& getPrimitiveOrder() const { return primitives; }
+
+	void clear();
+
+	// Recompute the bounds of the nodes bottom-up from those of the
+	// objects, keeping the tree as it is.  Fails once the SAH cost of the
+	// tree has grown past REBUILD_COST_RATIO times its cost when built.
+	virtual bool refit();
+
+	bool empty() const { return nodes.empty(); }
+
+	// takes effect at the next build
+	void setSpatialSplits( bool enable ) { spatial_splits = enable; }
+
+	// Leaves whose objects are intersected this many at a time, for as
+	// much as one, are priced that way by the SAH, so that they fill up;
+	// takes effect at the next build.
+	void setLeafWidth( int width ) { leaf_width = width; }
+
+	virtual bool write( vector<char>& out, const vector<Geometry*>& objs ) const;
+	virtual bool read( const char*& data, const char* end, const vector<Geometry*>& objs );
+
+	// Front-to-back traversal: the nearer child of a node is visited first,
+	// and a node is skipped once the ray enters it beyond tMax.
+	virtual void traverse( const ray& r, double tMax, AcceleratorVisitor& visitor ) const;
+
+protected:
+	// Packets go down the tree together, as in WideBVH: every node is
+	// fetched once for all the rays that reach it, its children are tested
+	// against the frustum if given and then against those rays alone, and
+	// a leaf's objects get all of them at once.  A subtree that only a few
+	// rays of the packet enter is finished ray by ray instead.
+	virtual void tracePacket( int count, const ray* const* r, isect* const* i, bool local, const Frustum* frustum ) const;
+
+	// Nodes are stored depth-first in a flat array: the first child of an
+	// interior node immediately follows it, the second child is at "offset".
+	struct Node {
+		BoundingBox	bounds;
+		int			offset;		// leaf: first object, interior: second child
+		int			count;		// number of objects in a leaf, 0 if interior
+	};
+
+	// per-object data only needed while building
+	struct BuildEntry {
+		Geometry*	obj;
+		int			primitive;		// for buildPrimitives(), else unused
+		BoundingBox	bounds;
+		vec3f		centroid;
+	};
+
+	// the bin of a centroid along the split axis, as in the SAH evaluation
+	struct BinIndex {
+		int		axis;
+		double	origin;
+		double	scale;
+
+		int operator()( const BuildEntry& e ) const
+		{ return std::min( (int)((e.centroid[axis] - origin) * scale), NUM_BINS - 1 ); }
+	};
+
+	void buildEntries( vector<BuildEntry>& entries );
+
+	// The objects that a traversal has already handed to the visitor, out
+	// of those that spatial splits put in several leaves.
+	class VisitedSet {
+	public:
+		VisitedSet()
+			: count( 0 ), more() {}
+
+		// add obj; false if it was already in
+		bool insert( Geometry* obj );
+
+	private:
+		Geometry*			first[16];
+		int					count;
+		vector<Geometry*>	more;
+	};
+
+	// should the object at index k of objects go to the visitor?
+	bool firstVisit( int k, VisitedSet& visited ) const
+	{ return duplicated.empty() || !duplicated[k] || visited.insert( objects[k] ); }
+
+	// the single-ray traversal of the subtree at index, which the ray
+	// enters at t
+	void traverseFrom( int index, double t, const ray& r, double tMax, AcceleratorVisitor& visitor ) const;
+
+	// of the rays of the packet in the mask, those that enter box before
+	// their closest hit so far, none if the box is outside the frustum;
+	// the nearest entry among them is put in t
+	static uint64_t intersectBox( const BoundingBox& box, uint64_t rays, int count, const ray* const* r, isect* const* i,
+		const Frustum* frustum, double& t );
+
+	// closest hits of the n rays with the objects, or primitives, of a leaf
+	void intersectLeaf( int first, int count, int n, const ray* const* r, isect* const* i, bool local ) const;
+
+	// the bounds the tree was built from: world space, or local for
+	// buildLocal()
+	BoundingBox objectBounds( Geometry* obj ) const;
+
+	// recompute the bounds of every node from objectBounds(), for refit()
+	void refitBounds();
+
+	// expected cost of a ray through the tree, by the SAH, relative to
+	// intersecting one object: the area of every node, weighted by what
+	// visiting it costs, over the area of the root
+	double cost() const;
+
+	// the SAH weight of a node with the given area and number of objects
+	// (0 if interior)
+	static double nodeCost( double area, int count );
+
+	// is a tree of this cost, refitted from one of build_cost, still good?
+	bool refitCostOK( double cost ) const;
+
+	// the number of objects or primitives the leaves index into
+	int numItems() const { return (int)(primitives.empty() ? objects.size() : primitives.size()); }
+
+	// After read(), which trusts no cache file to hold what write() put
+	// there: do the children of every node come after it, within nodes and
+	// no deeper than MAX_DEPTH, do the leaves stay within numItems(), and
+	// is the primitive order a permutation?
+	bool checkTree() const;
+
+	// Build the subtree over entries [begin, end), appending its nodes to
+	// out with the root first; the offsets of its interior nodes index out.
+	static void buildRecursive( vector<BuildEntry>& entries, int begin, int end, int depth, int leaf_width, vector<Node>& out );
+
+	// Choose where to split entries [begin, end) and partition them there;
+	// returns the first entry of the second half, or -1 for a leaf.
+	static int split( vector<BuildEntry>& entries, int begin, int end, int depth, const BoundingBox& bounds, int leaf_width, double* split_cost = NULL );
+
+	// Build the subtree over entries, which it consumes, with spatial splits
+	// allowed while the duplication budget lasts; leaves get their objects
+	// appended to the objects array.
+	void buildSpatial( vector<BuildEntry>& entries, int depth, double root_area, int& budget, vector<Node>& out );
+
+	// Look for a plane cutting the node's bounds that beats cost_limit by
+	// the SAH, and if there is one that the budget allows, distribute the
+	// entries to left and right, clipped, and return true.
+	bool spatialSplit( const vector<BuildEntry>& entries, const BoundingBox& bounds, double cost_limit, int& budget,
+		vector<BuildEntry>& left, vector<BuildEntry>& right ) const;
+
+	// the bounds of the part of an entry between lo and hi along axis
+	BoundingBox clipEntry( const BuildEntry& entry, int axis, double lo, double hi ) const;
+
+	vector<Node>		nodes;
+	vector<Geometry*>	objects;
+	// empty unless spatial splits duplicated some objects: then flags the
+	// indices of objects whose object is also elsewhere in it
+	vector<bool>		duplicated;
+	// instead of objects, for buildPrimitives()
+	vector<int>			primitives;
+	const PrimitiveIntersector*	primitive_owner;
+	bool				local;			// built by buildLocal()
+	bool				spatial_splits;
+	int					leaf_width;
+	double				build_cost;		// cost() right after the build, as refit() measures it
+
+	// Depth limit of the tree; the traversal stack is sized from it.
+	static const int MAX_DEPTH = 64;
+	// A node with at most this many objects may become a leaf.
+	static const int MAX_LEAF_SIZE = 4;
+	// Number of bins the SAH is evaluated over, along each axis.
+	static const int NUM_BINS = 32;
+	// Nodes with at least this many objects build their children as
+	// separate tasks.
+	static const int PARALLEL_MIN_OBJECTS = 4096;
+	// A packet entering a subtree with fewer rays than this is split up.
+	static const int PACKET_MIN_RAYS = 4;
+	// A refitted tree whose cost has grown by more than this factor is
+	// rebuilt.
+	static const double REBUILD_COST_RATIO;
+	// Spatial splits are only tried where the children of the best object
+	// split overlap by at least this fraction of the root's area...
+	static const double SPATIAL_SPLIT_MIN_OVERLAP;
+	// ...and may add at most this many references per object.
+	static const double SPATIAL_SPLIT_MAX_DUPLICATES;
+};
+
+
+#endif // __BVH_H__
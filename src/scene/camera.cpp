@@ -25,6 +25,45 @@ Camera::rayThrough( double x, double y, ray &r )
     r = ray( eye, dir.normalize() );
 }
 
+void
+Camera::frustumThrough( double x0, double y0, double x1, double y1, Frustum &f )
+{
+    const vec3f corners[4] = {
+        look + (x0 - 0.5) * u + (y0 - 0.5) * v,
+        look + (x1 - 0.5) * u + (y0 - 0.5) * v,
+        look + (x1 - 0.5) * u + (y1 - 0.5) * v,
+        look + (x0 - 0.5) * u + (y1 - 0.5) * v
+    };
+    const vec3f center = corners[0] + corners[1] + corners[2] + corners[3];
+
+    // each side holds the eye and two neighbouring corners; the rectangle
+    // may have been given either way round
+    f.eye = eye;
+    for( int k = 0; k < 4; ++k ) {
+        vec3f n = corners[k].cross( corners[(k + 1) % 4] );
+        if( n * center < 0.0 )
+            n = -n;
+        f.normals[k] = n;
+    }
+    f.normals[4] = look;
+}
+
+bool
+Frustum::overlaps( const vec3f &min, const vec3f &max ) const
+// The box is outside once the corner of it farthest along the normal of
+// some plane is still behind that plane.
+{
+    for( int k = 0; k < 5; ++k ) {
+        const vec3f &n = normals[k];
+        const vec3f far( n[0] > 0.0 ? max[0] : min[0],
+                         n[1] > 0.0 ? max[1] : min[1],
+                         n[2] > 0.0 ? max[2] : min[2] );
+        if( n * (far - eye) < 0.0 )
+            return false;
+    }
+    return true;
+}
+
 void
 Camera::setEye( const vec3f &eye )
 {
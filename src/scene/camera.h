@@ -3,11 +3,31 @@
 
 #include "ray.h"
 
+// The part of space that the camera sees through a rectangle of the
+// window: bounded by the planes through the eye and the edges of the
+// rectangle, and by the plane of the eye itself.
+class Frustum
+{
+public:
+    // may any part of the box [min, max] be inside?
+    bool overlaps( const vec3f &min, const vec3f &max ) const;
+
+private:
+    friend class Camera;
+
+    vec3f eye;
+    vec3f normals[5];           // of the planes, pointing inwards
+};
+
 class Camera
 {
 public:
     Camera();
     void rayThrough( double x, double y, ray &r );
+
+    // the frustum holding every ray through the window rectangle
+    // [x0, x1] x [y0, y1], in the normalized coordinates of rayThrough()
+    void frustumThrough( double x0, double y0, double x1, double y1, Frustum &f );
     void setEye( const vec3f &eye );
     void setLook( double, double, double, double );
     void setLook( const vec3f &viewDir, const vec3f &upDir );
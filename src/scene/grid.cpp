@@ -0,0 +1,166 @@
+#include <cmath>
+#include <algorithm>
+
+#include "grid.h"
+
+
+// Data Structure
+// Mailboxes: for every object, the id of the last ray that tested it.  They
+// are kept per thread so that concurrent traversals do not disturb each
+// other, and are reset whenever the thread moves on to another grid.
+class GridMailbox {
+public:
+	unsigned int			generation	= 0;
+	unsigned int			ray_id		= 0;
+	vector<unsigned int>	stamps;
+};
+
+
+// Static Data
+static thread_local GridMailbox	grid_mailbox;
+static unsigned int				grid_generation = 0;
+
+
+// Operation Handling
+void Grid::build( const list<Geometry*>& objs, const BoundingBox& b )
+{
+	objects.assign(objs.begin(), objs.end());
+	cell_start.clear();
+	cell_objects.clear();
+	generation = ++grid_generation;
+
+	// pad the bounds so that flat scenes still give cells a volume
+	bounds = b;
+	const vec3f pad = (bounds.max - bounds.min) * 0.001 + vec3f(RAY_EPSILON, RAY_EPSILON, RAY_EPSILON);
+	bounds.min -= pad;
+	bounds.max += pad;
+
+	// choose the resolution so that cells are roughly cubes and there are
+	// about CELLS_PER_OBJECT of them per object
+	const vec3f extent = bounds.max - bounds.min;
+	const double volume = extent[0] * extent[1] * extent[2];
+	const double cells_per_unit = cbrt(CELLS_PER_OBJECT * max<size_t>(objects.size(), 1) / volume);
+
+	for (int axis = 0; axis < 3; ++axis) {
+		res[axis] = (int)floor(extent[axis] * cells_per_unit + 0.5);
+		res[axis] = max(1, min(res[axis], (int)MAX_RESOLUTION));
+		cell_size[axis] = extent[axis] / res[axis];
+	}
+
+	// two passes: count the objects of every cell, then fill them in
+	const int num_cells = res[0] * res[1] * res[2];
+	cell_start.assign(num_cells + 1, 0);
+
+	for (int pass = 0; pass < 2; ++pass) {
+		vector<int> fill;
+		if (pass == 1) {
+			for (int c = 0; c < num_cells; ++c) {
+				cell_start[c + 1] += cell_start[c];
+			}
+			cell_objects.resize(cell_start[num_cells]);
+			fill.assign(cell_start.begin(), cell_start.end() - 1);
+		}
+
+		for (int k = 0; k < (int)objects.size(); ++k) {
+			const BoundingBox& box = objects[k]->getBoundingBox();
+			int lo[3], hi[3];
+			for (int axis = 0; axis < 3; ++axis) {
+				lo[axis] = cellCoord(box.min[axis], axis);
+				hi[axis] = cellCoord(box.max[axis], axis);
+			}
+
+			for (int z = lo[2]; z <= hi[2]; ++z) {
+				for (int y = lo[1]; y <= hi[1]; ++y) {
+					for (int x = lo[0]; x <= hi[0]; ++x) {
+						const int c = cellIndex(x, y, z);
+						if (pass == 0)	++cell_start[c + 1];
+						else			cell_objects[fill[c]++] = k;
+					}
+				}
+			}
+		}
+	}
+}
+
+
+int Grid::cellCoord( double p, int axis ) const
+{
+	const int c = (int)floor((p - bounds.min[axis]) / cell_size[axis]);
+	return max(0, min(c, res[axis] - 1));
+}
+
+
+void Grid::traverse( const ray& r, double tMax, AcceleratorVisitor& visitor ) const
+{
+	if (objects.empty()) return;
+
+	double t_enter, t_exit;
+	if (!bounds.intersect(r, t_enter, t_exit)) return;
+	t_enter = max(t_enter, 0.0);
+	if (t_enter > tMax) return;
+
+	// a new ray id for the mailboxes of this thread
+	GridMailbox& mailbox = grid_mailbox;
+	if (mailbox.generation != generation || mailbox.stamps.size() != objects.size()) {
+		mailbox.generation = generation;
+		mailbox.ray_id = 0;
+		mailbox.stamps.assign(objects.size(), 0);
+	}
+	if (++mailbox.ray_id == 0) {
+		mailbox.stamps.assign(objects.size(), 0);
+		mailbox.ray_id = 1;
+	}
+
+	// set up the 3D-DDA from the point where the ray enters the grid
+	const vec3f p = r.at(t_enter);
+	const vec3f d = r.getDirection();
+
+	int		cell[3], step[3], out[3];
+	double	t_next[3], t_delta[3];
+
+	for (int axis = 0; axis < 3; ++axis) {
+		cell[axis] = cellCoord(p[axis], axis);
+
+		if (d[axis] > 0.0) {
+			step[axis]		= 1;
+			out[axis]		= res[axis];
+			t_next[axis]	= t_enter + (bounds.min[axis] + (cell[axis] + 1) * cell_size[axis] - p[axis]) / d[axis];
+			t_delta[axis]	= cell_size[axis] / d[axis];
+		} else if (d[axis] < 0.0) {
+			step[axis]		= -1;
+			out[axis]		= -1;
+			t_next[axis]	= t_enter + (bounds.min[axis] + cell[axis] * cell_size[axis] - p[axis]) / d[axis];
+			t_delta[axis]	= -cell_size[axis] / d[axis];
+		} else {
+			// parallel to this axis: never crosses into another cell along it
+			step[axis]		= 0;
+			out[axis]		= -1;
+			t_next[axis]	= 1.0e308;
+			t_delta[axis]	= 1.0e308;
+		}
+	}
+
+	while (true) {
+		const int c = cellIndex(cell[0], cell[1], cell[2]);
+
+		for (int k = cell_start[c]; k < cell_start[c + 1]; ++k) {
+			const int index = cell_objects[k];
+			if (mailbox.stamps[index] == mailbox.ray_id) continue;
+			mailbox.stamps[index] = mailbox.ray_id;
+
+			if (!visitor.visit(objects[index], r, tMax)) return;
+		}
+
+		// step into the neighbouring cell across the nearest boundary, unless
+		// everything wanted lies before that boundary
+		int axis = 0;
+		if (t_next[1] < t_next[axis]) axis = 1;
+		if (t_next[2] < t_next[axis]) axis = 2;
+
+		if (tMax < t_next[axis]) return;
+
+		cell[axis] += step[axis];
+		if (cell[axis] == out[axis] || step[axis] == 0) return;
+		t_next[axis] += t_delta[axis];
+	}
+}
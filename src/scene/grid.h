@@ -0,0 +1,58 @@
+//
+// grid.h
+//
+// A uniform grid over the scene's bounding box.  Each cell lists the
+// objects whose bounding boxes overlap it, and a ray walks the cells it
+// crosses in order with a 3D-DDA.  On scenes made of many similar-sized
+// objects this is often cheaper than descending a tree.
+//
+
+#ifndef __GRID_H__
+#define __GRID_H__
+
+
+#include <list>
+#include <vector>
+
+#include "scene.h"
+#include "accelerator.h"
+
+
+class Grid: public Accelerator {
+public:
+	Grid()
+		: objects(), cell_start(), cell_objects(), generation( 0 ) {}
+
+	virtual void build( const list<Geometry*>& objs, const BoundingBox& bounds );
+
+	// Cells are visited front to back and the walk stops once tMax lies
+	// before the next cell.  Objects overlapping several cells are handed
+	// to the visitor only once per ray (mailboxing).
+	virtual void traverse( const ray& r, double tMax, AcceleratorVisitor& visitor ) const;
+
+protected:
+	int cellIndex( int x, int y, int z ) const { return (z * res[1] + y) * res[0] + x; }
+
+	// the cell containing the coordinate p along the given axis, clamped to the grid
+	int cellCoord( double p, int axis ) const;
+
+	BoundingBox			bounds;
+	vec3f				cell_size;
+	int					res[3];
+
+	vector<Geometry*>	objects;
+	// the objects of cell c are cell_objects[cell_start[c]] .. cell_objects[cell_start[c + 1] - 1]
+	vector<int>			cell_start;
+	vector<int>			cell_objects;
+
+	// identifies this build to the per-thread mailboxes
+	unsigned int		generation;
+
+	// target number of cells per object
+	static const int CELLS_PER_OBJECT = 2;
+	// limit of the resolution along each axis
+	static const int MAX_RESOLUTION = 128;
+};
+
+
+#endif // __GRID_H__
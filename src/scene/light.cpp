@@ -1,13 +1,65 @@
 #include <cmath>
+#include <vector>
 #include "light.h"
 #include "../ui/TraceUI.h"
 
 
+// Static Data
+static std::atomic<unsigned>	Light_next_id( 0 );
+
+// the last occluder of each light on this thread, by the light's id
+static thread_local std::vector<const Geometry*>	Light_last_occluder;
+
+
 // Static Function Prototype
 // ...
 
 
 // Operation Handling
+unsigned Light::newId() {
+	return Light_next_id++;
+}
+
+
+vec3f Light::shadowRay( const ray& r, double tmax ) const {
+	if (Light_last_occluder.size() <= id)
+		Light_last_occluder.resize(id + 1, NULL);
+	const Geometry*& last = Light_last_occluder[id];
+
+	// an opaque blocker lets nothing through, transmissive objects or not
+	if (last != NULL && last->occluded(r, tmax)) {
+		occluder_hits.fetch_add(1, std::memory_order_relaxed);
+		return vec3f(0.0, 0.0, 0.0);
+	}
+	occluder_misses.fetch_add(1, std::memory_order_relaxed);
+
+	// an object that lets some light through is kept all the same, as the
+	// test above only ever finds its opaque parts
+	Geometry* blocker = NULL;
+
+	// without transmissive objects, any object in the way blocks the light
+	if (!scene->hasTransmissiveObjects()) {
+		const bool blocked = scene->occluded(r, tmax, &blocker);
+		last = blocker;
+		return blocked ? vec3f(0.0, 0.0, 0.0) : vec3f(1.0, 1.0, 1.0);
+	}
+
+	// light intensity reduction due to energy loss when passing through the material
+	// 
+	// Problem:
+	// in the actual calculation,
+	// that this reduction will only happen when enter or leave the object
+	// but the in realility there will be some loss inside the object
+	//
+	// ps: loss in object is diff from air
+	// ps: currently distanceAttenuation only solve the air part
+	const vec3f atten = scene->transmittance(r, tmax, traceUI->getThreshold(), &blocker);
+	last = blocker;
+	return atten;
+}
+
+
+
 double DirectionalLight::distanceAttenuation( const vec3f& P ) const {
 	// distance to light is infinite, so f(di) goes to 0.  Return 1.
 	// range: 1.0 - 1.0
@@ -21,38 +73,12 @@ vec3f DirectionalLight::shadowAttenuation( const vec3f& P ) const {
 
 	// variable preparation
 	const vec3f& ray_dir = getDirection(P);  // from P to light source
-	vec3f point_light = P;
-	vec3f intensity_result(1.0, 1.0, 1.0);
 
 	// first push the ray a little bit forward to prevent hit the same point
 	// and cause dead loop
-	point_light = point_light + ray_dir * RAY_EPSILON;
-	while (!intensity_result.iszero()) {
-
-		// TODO: not yet decided the exact naming
-		isect i;
-		ray r(point_light, ray_dir);
-
-		// check if no intersect or intersection is behind the light source
-		if (!scene->intersect(r, i)) return intensity_result;
-
-		// light intensity reduction due to energy loss when passing through the material
-		// 
-		// Problem:
-		// in the actual calculation,
-		// that this reduction will only happen when enter or leave the object
-		// but the in realility there will be some loss inside the object
-		//
-		// ps: loss in object is diff from air
-		// ps: currently distanceAttenuation only solve the air part
-		intensity_result = prod(intensity_result, i.getMaterial().kt);
-
-		// push the ray forward a little bit
-		point_light = r.at(i.t) + ray_dir * RAY_EPSILON;
-
-	}
+	const ray r(P + ray_dir * RAY_EPSILON, ray_dir);
 
-	return intensity_result;
+	return shadowRay(r, 1.0e308);
 }
 
 
@@ -72,16 +98,10 @@ double PointLight::distanceAttenuation( const vec3f& P ) const {
 	// range: 0.0 - 1.0
 	// 1 / d ^ 2
 
-	double coeff_1, coeff_2, coeff_3;
-	if (traceUI->getIsOverrideAtten()) {
-		coeff_1 = traceUI->getAttenConstant();
-		coeff_2 = traceUI->getAttenLinear();
-		coeff_3 = traceUI->getAttenQuadric();
-	} else {
-		coeff_1 = attenuation_coeff[0];
-		coeff_2 = attenuation_coeff[1];
-		coeff_3 = attenuation_coeff[2];
-	}
+	const vec3f coeff = getAttenuationCoeff();
+	const double coeff_1 = coeff[0];
+	const double coeff_2 = coeff[1];
+	const double coeff_3 = coeff[2];
 
 	const double d2 = (P - position).length_squared();
 	const double d1 = sqrt(d2);
@@ -92,6 +112,41 @@ double PointLight::distanceAttenuation( const vec3f& P ) const {
 }
 
 
+vec3f PointLight::getAttenuationCoeff() const {
+	if (traceUI->getIsOverrideAtten())
+		return vec3f(traceUI->getAttenConstant(), traceUI->getAttenLinear(), traceUI->getAttenQuadric());
+	return attenuation_coeff;
+}
+
+
+// Solves c + l d + q d^2 = brightest / cutoff for d, the distance at which
+// the attenuated colour, brightest / (c + l d + q d^2), comes down to the
+// cutoff; the attenuation never goes above 1.
+double PointLight::getInfluenceRadius( double cutoff ) const {
+	const double brightest = std::max(color[0], std::max(color[1], color[2]));
+	if (brightest < cutoff)
+		return 0.0;
+	if (cutoff <= 0.0)
+		return HUGE_VAL;
+
+	const vec3f coeff = getAttenuationCoeff();
+	const double c = coeff[0];
+	const double l = coeff[1];
+	const double q = coeff[2];
+
+	// without a falloff that keeps growing, the light reaches everywhere
+	if (c < 0.0 || l < 0.0 || q < 0.0 || (l == 0.0 && q == 0.0))
+		return c * cutoff > brightest ? 0.0 : HUGE_VAL;
+
+	const double excess = c - brightest / cutoff;
+	if (excess > 0.0)
+		return 0.0;
+	if (q == 0.0)
+		return -excess / l;
+	return (-l + sqrt(l * l - 4.0 * q * excess)) / (2.0 * q);
+}
+
+
 vec3f PointLight::getColor( const vec3f& P ) const {
 	// Color doesn't depend on P 
 	return color;
@@ -109,40 +164,15 @@ vec3f PointLight::shadowAttenuation(const vec3f& P) const {
 
 	// variable preparation
 	const vec3f& ray_dir = getDirection(P); // from P to light source
-	vec3f point_light = P;					// the point of ray toward the light source
-	vec3f intensity_result(1.0, 1.0, 1.0);
 
 	// first push the ray a little bit forward to prevent hit the same point
 	// and cause dead loop
-	point_light = point_light + ray_dir * RAY_EPSILON;
-	while (!intensity_result.iszero()) {
-
-		// TODO: not yet decided the exact naming
-		isect i;
-		ray r(point_light, ray_dir);
-		const double length_light = (position - point_light).length();
-
-		// check if no intersect or intersection is behind the light source
-		if (!scene->intersect(r, i))	return intensity_result;
-		if (i.t >= length_light)		return intensity_result;
-
-		// light intensity reduction due to energy loss when passing through the material
-		// 
-		// Problem:
-		// in the actual calculation,
-		// that this reduction will only happen when enter or leave the object
-		// but the in realility there will be some loss inside the object
-		//
-		// ps: loss in object is diff from air
-		// ps: currently distanceAttenuation only solve the air part
-		intensity_result = prod(intensity_result, i.getMaterial().kt);
-
-		// push the ray forward a little bit
-		point_light = r.at(i.t) + ray_dir * RAY_EPSILON;
-
-	}
+	const vec3f point_light = P + ray_dir * RAY_EPSILON;	// the point of ray toward the light source
+	const double length_light = (position - point_light).length();
+	const ray r(point_light, ray_dir);
 
-	return intensity_result;
+	// everything up to the light
+	return shadowRay(r, length_light);
 }
 
 
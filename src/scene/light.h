@@ -2,6 +2,8 @@
 #define __LIGHT_H__
 
 
+#include <atomic>
+
 #include "scene.h"
 
 
@@ -12,12 +14,33 @@ public:
 	virtual vec3f getColor( const vec3f& P ) const = 0;
 	virtual vec3f getDirection( const vec3f& P ) const = 0;
 
+	// statistics of the occluder cache: shadow rays settled by the object
+	// that blocked the light's previous one (hits), and those that needed
+	// a search of the scene (misses)
+	unsigned long long getOccluderHits() const { return occluder_hits; }
+	unsigned long long getOccluderMisses() const { return occluder_misses; }
+
 protected:
 	Light( Scene *scene, const vec3f& col )
-		: SceneElement( scene ), color( col ) {}
+		: SceneElement( scene ), color( col ), id( newId() ), occluder_hits( 0 ), occluder_misses( 0 ) {}
+
+	// What gets through to the light along r before tmax.  Neighbouring
+	// points tend to be shadowed by the same object, so the object that
+	// blocked the previous shadow ray of this light, on the same thread, is
+	// tried before the scene is searched.
+	vec3f shadowRay( const ray& r, double tmax ) const;
 
 	vec3f 		color;
 
+private:
+	static unsigned newId();
+
+	// never reused, so that a thread's cache cannot mistake a new light
+	// for a deleted one
+	const unsigned	id;
+
+	mutable std::atomic<unsigned long long>	occluder_hits;
+	mutable std::atomic<unsigned long long>	occluder_misses;
 };
 
 
@@ -47,7 +70,18 @@ public:
 	virtual vec3f getDirection( const vec3f& P ) const;
 	void setDistanceAttenuationCoeff(const vec3f& coeff);
 
+	const vec3f& getPosition() const { return position; }
+
+	// The distance beyond which no component of the light's colour, after
+	// distance attenuation, is as much as cutoff: 0 if it never is, and
+	// HUGE_VAL if it always is, as without attenuation.
+	double getInfluenceRadius( double cutoff ) const;
+
 protected:
+	// the constant, linear and quadratic coefficients in effect, which the
+	// UI may override
+	vec3f getAttenuationCoeff() const;
+
 	vec3f		position;
 	vec3f		attenuation_coeff;
 };
@@ -0,0 +1,120 @@
+#include <cmath>
+#include <algorithm>
+
+#include "lightgrid.h"
+
+
+// Operation Handling
+void LightGrid::build( const list<Light*>& lights, double cutoff )
+{
+	entries.clear();
+	cell_start.clear();
+	cell_entries.clear();
+	others.clear();
+
+	for (list<Light*>::const_iterator l = lights.begin(); l != lights.end(); ++l) {
+		const PointLight* point = dynamic_cast<const PointLight*>(*l);
+		if (point == NULL) {
+			others.push_back(*l);
+			continue;
+		}
+
+		// a light that never gives as much as the cutoff is left out
+		const double radius = point->getInfluenceRadius(cutoff);
+		if (radius <= 0.0)
+			continue;
+		if (radius == HUGE_VAL) {
+			others.push_back(*l);
+			continue;
+		}
+
+		Entry entry;
+		entry.light		= point;
+		entry.position	= point->getPosition();
+		entry.radius2	= radius * radius;
+		entries.push_back(entry);
+	}
+
+	if (entries.empty())
+		return;
+
+	// the bounds of all the spheres, and cells about as wide as the
+	// average sphere, so that a point sees few lights that miss it
+	double sum_radius = 0.0;
+	for (size_t k = 0; k < entries.size(); ++k) {
+		const double radius = sqrt(entries[k].radius2);
+		const vec3f r(radius, radius, radius);
+		if (k == 0) {
+			bounds.min = entries[k].position - r;
+			bounds.max = entries[k].position + r;
+		} else {
+			bounds.min = minimum(bounds.min, entries[k].position - r);
+			bounds.max = maximum(bounds.max, entries[k].position + r);
+		}
+		sum_radius += radius;
+	}
+
+	const double cell_width = 2.0 * sum_radius / entries.size();
+	const vec3f extent = bounds.max - bounds.min;
+	for (int axis = 0; axis < 3; ++axis) {
+		res[axis] = (int)ceil(extent[axis] / cell_width);
+		res[axis] = max(1, min(res[axis], (int)MAX_RESOLUTION));
+		cell_size[axis] = extent[axis] / res[axis];
+	}
+
+	// two passes: count the lights of every cell, then fill them in
+	const int num_cells = res[0] * res[1] * res[2];
+	cell_start.assign(num_cells + 1, 0);
+
+	for (int pass = 0; pass < 2; ++pass) {
+		vector<int> fill;
+		if (pass == 1) {
+			for (int c = 0; c < num_cells; ++c) {
+				cell_start[c + 1] += cell_start[c];
+			}
+			cell_entries.resize(cell_start[num_cells]);
+			fill.assign(cell_start.begin(), cell_start.end() - 1);
+		}
+
+		for (size_t k = 0; k < entries.size(); ++k) {
+			const double radius = sqrt(entries[k].radius2);
+			int lo[3], hi[3];
+			for (int axis = 0; axis < 3; ++axis) {
+				lo[axis] = cellCoord(entries[k].position[axis] - radius, axis);
+				hi[axis] = cellCoord(entries[k].position[axis] + radius, axis);
+			}
+
+			for (int z = lo[2]; z <= hi[2]; ++z) {
+				for (int y = lo[1]; y <= hi[1]; ++y) {
+					for (int x = lo[0]; x <= hi[0]; ++x) {
+						const int c = cellIndex(x, y, z);
+						if (pass == 0)	++cell_start[c + 1];
+						else			cell_entries[fill[c]++] = entries[k];
+					}
+				}
+			}
+		}
+	}
+}
+
+
+void LightGrid::find( const vec3f& P, const Entry*& begin, const Entry*& end ) const
+{
+	begin = end = NULL;
+	if (cell_entries.empty()) return;
+
+	for (int axis = 0; axis < 3; ++axis) {
+		if (P[axis] < bounds.min[axis] || P[axis] > bounds.max[axis]) return;
+	}
+
+	const int c = cellIndex(cellCoord(P[0], 0), cellCoord(P[1], 1), cellCoord(P[2], 2));
+	begin	= &cell_entries[0] + cell_start[c];
+	end		= &cell_entries[0] + cell_start[c + 1];
+}
+
+
+int LightGrid::cellCoord( double p, int axis ) const
+{
+	const int c = (int)floor((p - bounds.min[axis]) / cell_size[axis]);
+	return max(0, min(c, res[axis] - 1));
+}
@@ -0,0 +1,68 @@
+//
+// lightgrid.h
+//
+// A uniform grid of the point lights over the space they can reach.  With
+// distance attenuation, a point light gives less than any cutoff beyond
+// some radius; each cell lists the lights whose sphere of that radius
+// overlaps it, so a point is only shaded with the few lights of its cell
+// that reach it, instead of every light of the scene.  Lights that reach
+// everywhere, such as directional ones, are listed apart.
+//
+
+#ifndef __LIGHTGRID_H__
+#define __LIGHTGRID_H__
+
+
+#include <list>
+#include <vector>
+
+#include "scene.h"
+#include "light.h"
+
+
+class LightGrid {
+public:
+	struct Entry {
+		const PointLight	*light;
+		vec3f				position;
+		double				radius2;		// of its influence, squared
+	};
+
+	LightGrid()
+		: entries(), cell_start(), cell_entries(), others() {}
+
+	// Lay the grid over the lights, with the radii at which they give less
+	// than cutoff, for the distance attenuation in effect now.
+	void build( const list<Light*>& lights, double cutoff );
+
+	// the lights that reach everywhere
+	const vector<const Light*>& getOtherLights() const { return others; }
+
+	// The lights whose influence may cover P, in [begin, end); the sphere
+	// of each still has to be checked with reaches().
+	void find( const vec3f& P, const Entry*& begin, const Entry*& end ) const;
+
+	static bool reaches( const Entry& entry, const vec3f& P )
+	{ return (P - entry.position).length_squared() <= entry.radius2; }
+
+protected:
+	int cellIndex( int x, int y, int z ) const { return (z * res[1] + y) * res[0] + x; }
+
+	// the cell containing the coordinate p along the given axis, clamped to the grid
+	int cellCoord( double p, int axis ) const;
+
+	// at most this many cells along an axis
+	static const int	MAX_RESOLUTION = 64;
+
+	BoundingBox			bounds;
+	vec3f				cell_size;
+	int					res[3];
+
+	vector<Entry>		entries;
+	vector<int>			cell_start;		// per cell, its first entry in cell_entries
+	vector<Entry>		cell_entries;
+	vector<const Light*>	others;
+};
+
+
+#endif // __LIGHTGRID_H__
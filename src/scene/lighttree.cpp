@@ -0,0 +1,139 @@
+#include <cmath>
+#include <algorithm>
+
+#include "lighttree.h"
+
+
+// Static Function Prototype
+static double LightTree_power(const vec3f& color);
+
+
+// Operation Handling
+void LightTree::build( const list<Light*>& all )
+{
+	nodes.clear();
+	lights.clear();
+	others.clear();
+
+	for (list<Light*>::const_iterator l = all.begin(); l != all.end(); ++l) {
+		const PointLight* point = dynamic_cast<const PointLight*>(*l);
+		if (point != NULL)
+			lights.push_back(point);
+		else
+			others.push_back(*l);
+	}
+
+	if (lights.empty())
+		return;
+
+	vector<int> order(lights.size());
+	for (size_t k = 0; k < order.size(); ++k)
+		order[k] = (int)k;
+
+	nodes.reserve(2 * lights.size() - 1);
+	nodes.push_back(Node());
+	buildNode(0, &order[0], &order[0] + order.size());
+}
+
+
+// Each step down picks a child in proportion to its importance, so the
+// chance of reaching a leaf is the product of the choices on the way; u is
+// stretched over the chosen part again to serve the next step.
+const Light* LightTree::sample( const vec3f& P, const vec3f& N, double u, double& pdf ) const
+{
+	pdf = 1.0;
+	if (nodes.empty() || importance(nodes[0], P, N) <= 0.0)
+		return NULL;
+
+	int at = 0;
+	while (nodes[at].child >= 0) {
+		const int left = nodes[at].child;
+		const double a = importance(nodes[left], P, N);
+		const double b = importance(nodes[left + 1], P, N);
+		if (a + b <= 0.0)
+			return NULL;
+
+		const double p = a / (a + b);
+		if (u < p) {
+			at = left;
+			u = u / p;
+			pdf *= p;
+		} else {
+			at = left + 1;
+			u = (u - p) / (1.0 - p);
+			pdf *= 1.0 - p;
+		}
+		u = std::min(u, 1.0 - 1e-12);
+	}
+
+	return lights[nodes[at].light];
+}
+
+
+// The children of a node are added next to each other, for child and
+// child + 1.
+void LightTree::buildNode( int at, int* begin, int* end )
+{
+	Node node;
+	node.min = node.max = lights[*begin]->getPosition();
+	node.power = 0.0;
+	for (int* l = begin; l != end; ++l) {
+		node.min = minimum(node.min, lights[*l]->getPosition());
+		node.max = maximum(node.max, lights[*l]->getPosition());
+		node.power += LightTree_power(lights[*l]->getColor(node.min));
+	}
+
+	if (end - begin == 1) {
+		node.child = -1;
+		node.light = *begin;
+		nodes[at] = node;
+		return;
+	}
+
+	// halve the lights along the widest extent of their positions
+	const vec3f extent = node.max - node.min;
+	int axis = 0;
+	if (extent[1] > extent[axis]) axis = 1;
+	if (extent[2] > extent[axis]) axis = 2;
+
+	int* mid = begin + (end - begin) / 2;
+	nth_element(begin, mid, end, [this, axis](int a, int b) {
+		return lights[a]->getPosition()[axis] < lights[b]->getPosition()[axis];
+	});
+
+	node.child = (int)nodes.size();
+	node.light = -1;
+	nodes[at] = node;
+
+	nodes.push_back(Node());
+	nodes.push_back(Node());
+	buildNode(node.child, begin, mid);
+	buildNode(node.child + 1, mid, end);
+}
+
+
+// A leaf knows its light's own falloff.  For a group of lights, their power
+// falls off with the square of the distance to the nearest point of their
+// bounds, never rising above the power itself, as no light's does.  Lights
+// wholly behind the surface cannot light it.
+double LightTree::importance( const Node& node, const vec3f& P, const vec3f& N ) const
+{
+	const vec3f corner( N[0] > 0.0 ? node.max[0] : node.min[0],
+	                    N[1] > 0.0 ? node.max[1] : node.min[1],
+	                    N[2] > 0.0 ? node.max[2] : node.min[2] );
+	if (N * (corner - P) <= 0.0)
+		return 0.0;
+
+	if (node.child < 0)
+		return node.power * lights[node.light]->distanceAttenuation(P);
+
+	const vec3f nearest = minimum(maximum(P, node.min), node.max);
+	const double d2 = (nearest - P).length_squared();
+	return d2 > 1.0 ? node.power / d2 : node.power;
+}
+
+
+// Static Function Implementation
+static double LightTree_power(const vec3f& color) {
+	return color[0] + color[1] + color[2];
+}
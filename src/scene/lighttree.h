@@ -0,0 +1,60 @@
+//
+// lighttree.h
+//
+// A binary tree over the point lights of a scene, each node knowing the
+// bounds and the total power of the lights below it.  Instead of shading
+// with every light, a point can pick a few, each by walking down the tree
+// towards the lights that are likely to matter most to it; dividing what
+// the picked light gives by the chance of picking it keeps the result
+// unbiased.  Lights without a position, directional ones, stay out of the
+// tree and are always shaded with.
+//
+
+#ifndef __LIGHTTREE_H__
+#define __LIGHTTREE_H__
+
+
+#include <list>
+#include <vector>
+
+#include "scene.h"
+#include "light.h"
+
+
+class LightTree {
+public:
+	LightTree()
+		: nodes(), lights(), others() {}
+
+	void build( const list<Light*>& lights );
+
+	// Pick a light for the point P with normal N, in proportion to the
+	// estimated contribution of each, using u from [0, 1).  Returns NULL if
+	// no light in the tree can reach P, else the light, with the chance of
+	// picking it in pdf.
+	const Light* sample( const vec3f& P, const vec3f& N, double u, double& pdf ) const;
+
+	// the lights left out of the tree
+	const vector<const Light*>& getOtherLights() const { return others; }
+
+private:
+	struct Node {
+		vec3f	min, max;			// of the positions of the lights below
+		double	power;				// their summed colour
+		int		child;				// the first of two children; -1 for a leaf
+		int		light;				// of a leaf
+	};
+
+	// fill in nodes[at] over the lights [begin, end)
+	void buildNode( int at, int* begin, int* end );
+
+	// estimated contribution of the lights below the node to P
+	double importance( const Node& node, const vec3f& P, const vec3f& N ) const;
+
+	vector<Node>				nodes;
+	vector<const PointLight*>	lights;
+	vector<const Light*>		others;
+};
+
+
+#endif // __LIGHTTREE_H__
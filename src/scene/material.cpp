@@ -1,7 +1,11 @@
 #include <algorithm>
+#include <cstring>
+#include <random>
 #include "ray.h"
 #include "material.h"
 #include "light.h"
+#include "lighttree.h"
+#include "lightgrid.h"
 #include "../ui/TraceUI.h"
 
 
@@ -10,6 +14,12 @@
 // find the ambient intensity of certain point
 static vec3f RayTrace_PhongModel_getAmbientLightIntensity(Scene *scene, const vec3f &point);
 
+// the diffuse and specular intensity that one light gives the point
+static vec3f RayTrace_PhongModel_getLightIntensity(const Material &material, const Light *light, const ray &r, const isect &i, const vec3f &point);
+
+// a seed for picking lights at the point, made from its coordinates alone
+static unsigned RayTrace_PhongModel_seed(const vec3f &point);
+
 
 // Operation
 // Apply the phong model to this point on the surface of the object, returning
@@ -50,46 +60,51 @@ vec3f Material::shade( Scene *scene, const ray& r, const isect& i ) const {
 		intensity_result += prod(prod(ka, intensity_ambient), raw_one - kt);
 	}
 
+	// light sampling
+	// a few lights picked from the tree stand in for all of them, each
+	// weighted by the inverse of the chance of picking it
+	const LightTree* light_tree = scene->getLightTree();
+	if (light_tree != NULL) {
+		for (auto* light : light_tree->getOtherLights()) {
+			intensity_result += RayTrace_PhongModel_getLightIntensity(*this, light, r, i, point_isect);
+		}
+
+		// the same point picks the same lights in every render, whichever
+		// thread shades it and in whatever order
+		const int samples = scene->getLightSamples();
+		std::minstd_rand random(RayTrace_PhongModel_seed(point_isect));
+		std::uniform_real_distribution<double> uniform(0.0, 1.0);
+		for (int k = 0; k < samples; ++k) {
+			double pdf;
+			const Light* light = light_tree->sample(point_isect, i.N, uniform(random), pdf);
+			if (light == NULL) continue;  // the walk ended with lights that cannot reach the point
+
+			intensity_result += RayTrace_PhongModel_getLightIntensity(*this, light, r, i, point_isect) / (pdf * samples);
+		}
+
+		return intensity_result;
+	}
+
+	// light cutoff
+	// only the lights of the point's cell that reach it
+	const LightGrid* light_grid = scene->getLightGrid();
+	if (light_grid != NULL) {
+		for (auto* light : light_grid->getOtherLights()) {
+			intensity_result += RayTrace_PhongModel_getLightIntensity(*this, light, r, i, point_isect);
+		}
+
+		const LightGrid::Entry *begin, *end;
+		light_grid->find(point_isect, begin, end);
+		for (const LightGrid::Entry* entry = begin; entry != end; ++entry) {
+			if (LightGrid::reaches(*entry, point_isect))
+				intensity_result += RayTrace_PhongModel_getLightIntensity(*this, entry->light, r, i, point_isect);
+		}
+
+		return intensity_result;
+	}
+
 	for (auto* light : scene->getLights()) {
-		const double dot_ln = i.N.dot(light->getDirection(point_isect));
-		
-		// if the light source is behind the plane,
-		// then ignore it
-		if (dot_ln <= 0.0) continue;
-
-		// shadow attenuation
-		// if the atten_shadow is zero, which means no light from the source (blocked)
-		// then ignore it
-		const vec3f &atten_shadow = light->shadowAttenuation(point_isect);
-		if (atten_shadow.iszero()) continue;
-
-		// distance attenuation
-		// normally the value will not be zero (1 / d^2) if d != inf
-		// TODO: give a threshold to a light intensity smaller than some value to be zero
-		// TOOD: to reduce the workload
-		const double atten_distance = light->distanceAttenuation(point_isect);
-		const vec3f& attenuation = atten_shadow * atten_distance;
-
-		// diffuse term
-		const vec3f& term_diffuse = prod(kd * dot_ln, raw_one - kt);
-
-		// specular term
-		// reflected = 2 * projection of income ray on normal - income ray
-		// be careful of the direction
-		// direction of light->getDirection(): away from the intersection
-		const vec3f& ray_reflect	= (2.0 * dot_ln * i.N - light->getDirection(point_isect)).normalize();
-		const double dot_rv			= std::max<double>(ray_reflect.dot(-r.getDirection()), 0.0);
-		const double coeff_specular = pow(dot_rv, shininess * 128);  // 128 is power of 2
-		const vec3f& term_specular	= ks * coeff_specular;
-
-		// diffuse term + specular term
-		const vec3f& term_result = term_diffuse + term_specular;
-
-		// light intensity
-		const vec3f& intensity_light = light->getColor(point_isect);
-
-		// result += attenuation * term
-		intensity_result += prod(prod(attenuation, intensity_light), term_result);
+		intensity_result += RayTrace_PhongModel_getLightIntensity(*this, light, r, i, point_isect);
 	}
 
 	return intensity_result;
@@ -104,3 +119,64 @@ static vec3f RayTrace_PhongModel_getAmbientLightIntensity(Scene *scene, const ve
 	}
 	return result;
 }
+
+
+static vec3f RayTrace_PhongModel_getLightIntensity(const Material &material, const Light *light, const ray &r, const isect &i, const vec3f &point) {
+	const vec3f raw_one(1.0, 1.0, 1.0);
+	const double dot_ln = i.N.dot(light->getDirection(point));
+	
+	// if the light source is behind the plane,
+	// then ignore it
+	if (dot_ln <= 0.0) return vec3f();
+
+	// shadow attenuation
+	// if the atten_shadow is zero, which means no light from the source (blocked)
+	// then ignore it
+	const vec3f &atten_shadow = light->shadowAttenuation(point);
+	if (atten_shadow.iszero()) return vec3f();
+
+	// distance attenuation
+	// normally the value will not be zero (1 / d^2) if d != inf
+	// lights too far away to matter are left out by the light grid
+	// (see Scene::setLightCutoff) before their shadow rays are cast
+	const double atten_distance = light->distanceAttenuation(point);
+	const vec3f& attenuation = atten_shadow * atten_distance;
+
+	// diffuse term
+	const vec3f& term_diffuse = prod(material.kd * dot_ln, raw_one - material.kt);
+
+	// specular term
+	// reflected = 2 * projection of income ray on normal - income ray
+	// be careful of the direction
+	// direction of light->getDirection(): away from the intersection
+	const vec3f& ray_reflect	= (2.0 * dot_ln * i.N - light->getDirection(point)).normalize();
+	const double dot_rv			= std::max<double>(ray_reflect.dot(-r.getDirection()), 0.0);
+	const double coeff_specular = pow(dot_rv, material.shininess * 128);  // 128 is power of 2
+	const vec3f& term_specular	= material.ks * coeff_specular;
+
+	// diffuse term + specular term
+	const vec3f& term_result = term_diffuse + term_specular;
+
+	// light intensity
+	const vec3f& intensity_light = light->getColor(point);
+
+	// result += attenuation * term
+	return prod(prod(attenuation, intensity_light), term_result);
+}
+
+
+// The bits of the three coordinates are mixed as by splitmix64, so that
+// neighbouring points get unrelated seeds.
+static unsigned RayTrace_PhongModel_seed(const vec3f &point) {
+	unsigned long long hash = 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		const double coordinate = point[axis];
+		unsigned long long bits;
+		memcpy(&bits, &coordinate, sizeof(bits));
+		hash = (hash ^ bits) + 0x9e3779b97f4a7c15ULL;
+		hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+		hash ^= hash >> 31;
+	}
+	return (unsigned)(hash ^ (hash >> 32));
+}
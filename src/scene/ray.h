@@ -14,17 +14,28 @@ class SceneObject;
 
 // A ray has a position where the ray starts, and a direction (which should
 // always be normalized!)
+//
+// The reciprocal of the direction and the sign of each of its components
+// are computed along with it, for the slab tests of boxes.  A zero
+// component has an infinite reciprocal, with the sign of the zero.
 
 class ray {
 public:
+	ray()
+		: p(), d(), inv_d() { sign[0] = sign[1] = sign[2] = 0; }
 	ray( const vec3f& pp, const vec3f& dd )
-		: p( pp ), d( dd ) {}
+		: p( pp ), d( dd ) { setInverse(); }
 	ray( const ray& other ) 
-		: p( other.p ), d( other.d ) {}
+		: p( other.p ), d( other.d ), inv_d( other.inv_d )
+	{ sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2]; }
 	~ray() {}
 
 	ray& operator =( const ray& other ) 
-	{ p = other.p; d = other.d; return *this; }
+	{
+		p = other.p; d = other.d; inv_d = other.inv_d;
+		sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2];
+		return *this;
+	}
 
 	vec3f at( double t ) const
 	{ return p + (t*d); }
@@ -32,9 +43,25 @@ public:
 	vec3f getPosition() const { return p; }
 	vec3f getDirection() const { return d; }
 
+	// 1 / the direction, per component
+	const vec3f& getInverseDirection() const { return inv_d; }
+
+	// 1 if the direction is negative along axis (or -0), else 0
+	int getSign( int axis ) const { return sign[axis]; }
+
 protected:
+	void setInverse()
+	{
+		for( int axis = 0; axis < 3; ++axis ) {
+			inv_d[axis] = 1.0 / d[axis];
+			sign[axis] = inv_d[axis] < 0.0;
+		}
+	}
+
 	vec3f p;
 	vec3f d;
+	vec3f inv_d;
+	int sign[3];
 };
 
 // The description of an intersection point.
@@ -93,4 +120,7 @@ public:
 const double RAY_EPSILON = 0.00001;
 const double NORMAL_EPSILON = 0.00001;
 
+// the most rays traced together as one packet
+const int RAY_PACKET_SIZE = 64;
+
 #endif // __RAY_H__
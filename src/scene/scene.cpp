@@ -1,7 +1,16 @@
 #include <cmath>
+#include <chrono>
 
 #include "scene.h"
 #include "light.h"
+#include "accelerator.h"
+#include "bvh.h"
+#include "grid.h"
+#include "widebvh.h"
+#include "acceleratorcache.h"
+#include "lighttree.h"
+#include "lightgrid.h"
+#include "tasks.h"
 #include "../ui/TraceUI.h"
 extern TraceUI* traceUI;
 
@@ -26,67 +35,172 @@ bool BoundingBox::intersects(const vec3f& point) const
 		 (point[0] - RAY_EPSILON <= max[0]) && (point[1] - RAY_EPSILON <= max[1]) && (point[2] - RAY_EPSILON <= max[2]));
 }
 
+// grow this bounding box so that it also encloses the target
+void BoundingBox::merge(const BoundingBox& target)
+{
+	min = minimum(min, target.min);
+	max = maximum(max, target.max);
+}
+
+// surface area of the box, as used by the surface area heuristic
+double BoundingBox::area() const
+{
+	vec3f d = max - min;
+	return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
 // if the ray hits the box, put the "t" value of the intersection
 // closest to the origin in tMin and the "t" value of the far intersection
 // in tMax and return true, else return false.
-// Using Kay/Kajiya algorithm.
+// Using Kay/Kajiya algorithm, without branches: the sign of the direction
+// picks the near and far planes of each slab, and a zero component gives
+// infinite distances through the ray's reciprocal direction.  The NaN of a
+// ray lying in a slab's plane fails every comparison, so it leaves tMin
+// and tMax as they were.
 bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 {
-	vec3f R0 = r.getPosition();
-	vec3f Rd = r.getDirection();
+	const vec3f R0 = r.getPosition();
+	const vec3f& inv = r.getInverseDirection();
+	const vec3f* planes[2] = { &min, &max };
 
 	tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
 	tMax = 1.0e308;
-	double ttemp;
-	
+
 	for (int currentaxis = 0; currentaxis < 3; currentaxis++)
 	{
-		double vd = Rd[currentaxis];
-		
-		// if the ray is parallel to the face's plane (=0.0)
-		if( vd == 0.0 )
-			continue;
+		const int s = r.getSign(currentaxis);
+		const double t1 = ((*planes[s])[currentaxis] - R0[currentaxis]) * inv[currentaxis];
+		const double t2 = ((*planes[1 - s])[currentaxis] - R0[currentaxis]) * inv[currentaxis];
+
+		tMin = t1 > tMin ? t1 : tMin;
+		tMax = t2 < tMax ? t2 : tMax;
+	}
+
+	// missed, or behind the ray
+	return tMin <= tMax && tMax >= 0.0;
+}
 
-		double v1 = min[currentaxis] - R0[currentaxis];
-		double v2 = max[currentaxis] - R0[currentaxis];
 
-		// two slab intersections
-		double t1 = v1/vd;
-		double t2 = v2/vd;
-		
-		if ( t1 > t2 ) { // swap t1 & t2
-			ttemp = t1;
-			t1 = t2;
-			t2 = ttemp;
+// The corners of the transformed box that lie between the planes, and the
+// points where its edges cross them, span the part of the box in between.
+BoundingBox Geometry::ComputeClippedBoundingBox(int axis, double lo, double hi)
+{
+	const BoundingBox localBounds = ComputeLocalBoundingBox();
+
+	vec3f corner[8];
+	for (int k = 0; k < 8; ++k) {
+		const vec3f p( (k & 1) ? localBounds.max[0] : localBounds.min[0],
+					   (k & 2) ? localBounds.max[1] : localBounds.min[1],
+					   (k & 4) ? localBounds.max[2] : localBounds.min[2] );
+		corner[k] = transform->localToGlobalCoords(p);
+	}
+
+	vec3f	points[8 + 12 * 2];
+	int		count = 0;
+
+	for (int k = 0; k < 8; ++k) {
+		if (corner[k][axis] >= lo && corner[k][axis] <= hi)
+			points[count++] = corner[k];
+	}
+
+	// the edges join the corners that differ in one bit
+	const double planes[2] = { lo, hi };
+	for (int a = 0; a < 8; ++a) {
+		for (int bit = 1; bit < 8; bit <<= 1) {
+			if (a & bit) continue;
+			const vec3f& p = corner[a];
+			const vec3f& q = corner[a | bit];
+
+			for (int k = 0; k < 2; ++k) {
+				if ((p[axis] - planes[k]) * (q[axis] - planes[k]) >= 0.0)
+					continue;
+				vec3f x = p + (q - p) * ((planes[k] - p[axis]) / (q[axis] - p[axis]));
+				x[axis] = planes[k];
+				points[count++] = x;
+			}
 		}
+	}
 
-		if (t1 > tMin)
-			tMin = t1;
-		if (t2 < tMax)
-			tMax = t2;
+	// nothing in between: say so with the plain cut world box
+	if (count == 0) {
+		BoundingBox clipped = bounds;
+		clipped.min[axis] = std::min(std::max(bounds.min[axis], lo), hi);
+		clipped.max[axis] = std::min(std::max(bounds.max[axis], lo), hi);
+		return clipped;
+	}
+
+	BoundingBox clipped;
+	clipped.min = clipped.max = points[0];
+	for (int k = 1; k < count; ++k) {
+		clipped.min = minimum(clipped.min, points[k]);
+		clipped.max = maximum(clipped.max, points[k]);
+	}
 
-		if (tMin > tMax) // box is missed
-			return false;
-		if (tMax < 0.0) // box is behind ray
-			return false;
+	// the crossings are interpolated, so allow for their rounding
+	for (int k = 0; k < 3; ++k) {
+		if (k == axis) continue;
+		clipped.min[k] -= RAY_EPSILON;
+		clipped.max[k] += RAY_EPSILON;
 	}
-	return true; // it made it past all 3 axes.
+	return clipped;
+}
+
+
+void LocalTransform::set( const mat4f& inverse )
+{
+	for( int k = 0; k < 3; ++k )
+		m[k] = inverse[k];
+
+	// the columns of the linear part, for the kind of transformation
+	const vec3f c[3] = {
+		vec3f( m[0][0], m[1][0], m[2][0] ),
+		vec3f( m[0][1], m[1][1], m[2][1] ),
+		vec3f( m[0][2], m[1][2], m[2][2] )
+	};
+
+	// the inverse was computed, so allow for its rounding
+	const double eps = 1e-12;
+
+	bool unit = true;
+	for( int j = 0; j < 3; ++j ) {
+		for( int k = 0; k < 3; ++k ) {
+			if( fabs( m[j][k] - (j == k ? 1.0 : 0.0) ) > eps )
+				unit = false;
+		}
+	}
+
+	scale = inv_scale = 1.0;
+	if( unit ) {
+		for( int k = 0; k < 3; ++k )
+			m[k][k] = 1.0;
+		kind = (m[0][3] == 0.0 && m[1][3] == 0.0 && m[2][3] == 0.0) ? IDENTITY : TRANSLATE;
+		return;
+	}
+
+	const double length2 = c[0] * c[0];
+	const double tolerance = eps * length2;
+	if( length2 > 0.0 &&
+		fabs( c[1] * c[1] - length2 ) <= tolerance && fabs( c[2] * c[2] - length2 ) <= tolerance &&
+		fabs( c[0] * c[1] ) <= tolerance && fabs( c[0] * c[2] ) <= tolerance && fabs( c[1] * c[2] ) <= tolerance ) {
+		kind = UNIFORM;
+		scale = sqrt( length2 );
+		inv_scale = 1.0 / scale;
+		return;
+	}
+
+	kind = GENERAL;
 }
 
 
 bool Geometry::intersect(const ray&r, isect&i) const
 {
     // Transform the ray into the object's local coordinate space
-    vec3f pos = transform->globalToLocalCoords(r.getPosition());
-    vec3f dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
-    double length = dir.length();
-    dir /= length;
-
-    ray localRay( pos, dir );
+    ray localRay;
+    double length = local_transform.toLocal( r, localRay );
 
     if (intersectLocal(localRay, i)) {
         // Transform the intersection point & normal returned back into global space.
-		i.N = transform->localToGlobalCoordsNormal(i.N);
+		i.N = local_transform.normalToGlobal(i.N);
 		i.t /= length;
 
 		return true;
@@ -101,6 +215,64 @@ bool Geometry::intersectLocal( const ray& r, isect& i ) const
 	return false;
 }
 
+void Geometry::intersectPacket( int count, const ray* const* r, isect* const* i ) const
+{
+	for( int k = 0; k < count; ++k ) {
+		isect cur;
+		if( intersect( *r[k], cur ) && (i[k]->obj == NULL || cur.t < i[k]->t) )
+			*i[k] = cur;
+	}
+}
+
+bool Geometry::occluded(const ray& r, double tMax) const
+{
+    // Transform the ray into the object's local coordinate space, where t
+    // is scaled by the length of the transformed direction
+    ray localRay;
+    double length = local_transform.toLocal( r, localRay );
+
+    return occludedLocal(localRay, tMax * length);
+}
+
+bool Geometry::occludedLocal( const ray& r, double tMax ) const
+{
+	// by default, fall back to the full intersection; only the normal's
+	// transformation back to global space is saved
+	isect i;
+	if( !intersectLocal( r, i ) || i.t >= tMax )
+		return false;
+
+	return i.getMaterial().kt.iszero();
+}
+
+void Geometry::attenuate(const ray& r, double tMax, vec3f& atten) const
+{
+    ray localRay;
+    double length = local_transform.toLocal( r, localRay );
+
+    attenuateLocal(localRay, tMax * length, atten);
+}
+
+void Geometry::attenuateLocal( const ray& r, double tMax, vec3f& atten ) const
+{
+	// by default, step from one surface of the object to the next, pushing
+	// the ray a little bit forward each time so as not to hit the same
+	// point again
+	double t = 0.0;
+	while( !atten.iszero() ) {
+		isect i;
+		if( !intersectLocal( ray( r.at( t ), r.getDirection() ), i ) || i.t <= 0.0 )
+			return;
+
+		t += i.t;
+		if( t >= tMax )
+			return;
+
+		atten = prod( atten, i.getMaterial().kt );
+		t += RAY_EPSILON;
+	}
+}
+
 bool Geometry::hasBoundingBoxCapability() const
 {
 	// by default, primitives do not have to specify a bounding box.
@@ -132,9 +304,18 @@ Scene::~Scene()
 		delete (*g);
 	}
 
+	for( g = shared.begin(); g != shared.end(); ++g ) {
+		delete (*g);
+	}
+
 	for( l = lights.begin(); l != lights.end(); ++l ) {
 		delete (*l);
 	}
+
+	delete accelerator;
+	delete cache;
+	delete light_tree;
+	delete light_grid;
 }
 
 // Get any intersection with an object.  Return information about the 
@@ -157,28 +338,150 @@ bool Scene::intersect( const ray& r, isect& i ) const
 		}
 	}
 
-	// try the bounded objects
-	for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
-		if( (*j)->intersect( r, cur ) ) {
+	// try the bounded objects, through the structure built by initScene()
+	if( accelerator != NULL ) {
+		if( accelerator->intersect( r, cur ) ) {
 			if( !have_one || (cur.t < i.t) ) {
 				i = cur;
 				have_one = true;
 			}
 		}
+	} else {
+		for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
+			if( (*j)->intersect( r, cur ) ) {
+				if( !have_one || (cur.t < i.t) ) {
+					i = cur;
+					have_one = true;
+				}
+			}
+		}
 	}
 
-
 	return have_one;
 }
 
+void Scene::intersectPacket( int count, const ray* const* r, isect* const* i ) const
+{
+	typedef list<Geometry*>::const_iterator iter;
+	iter j;
+
+	for( int k = 0; k < count; ++k )
+		i[k]->obj = NULL;
+
+	// try the non-bounded objects
+	for( j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j )
+		(*j)->intersectPacket( count, r, i );
+
+	// try the bounded objects, through the structure built by initScene()
+	if( accelerator != NULL ) {
+		accelerator->intersectPacket( count, r, i );
+	} else {
+		for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j )
+			(*j)->intersectPacket( count, r, i );
+	}
+}
+
+// In the plain list every object is culled on its own.  The BVHs cull
+// their nodes as the packet goes down; the grid marches the rays one by
+// one, and any cell a ray of the frustum crosses overlaps it, so there only
+// the scene as a whole can be passed over.
+void Scene::intersectPacket( int count, const ray* const* r, isect* const* i, const Frustum& frustum ) const
+{
+	typedef list<Geometry*>::const_iterator iter;
+	iter j;
+
+	for( int k = 0; k < count; ++k )
+		i[k]->obj = NULL;
+
+	// the non-bounded objects cannot be culled
+	for( j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j )
+		(*j)->intersectPacket( count, r, i );
+
+	if( boundedobjects.empty() )
+		return;
+
+	if( accelerator != NULL ) {
+		if( frustum.overlaps( sceneBounds.min, sceneBounds.max ) )
+			accelerator->intersectPacket( count, r, i, &frustum );
+	} else {
+		for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
+			const BoundingBox& bounds = (*j)->getBoundingBox();
+			if( frustum.overlaps( bounds.min, bounds.max ) )
+				(*j)->intersectPacket( count, r, i );
+		}
+	}
+}
+
+bool Scene::occluded( const ray& r, double tmax, Geometry** blocker ) const
+{
+	typedef list<Geometry*>::const_iterator iter;
+	iter j;
+
+	// try the non-bounded objects
+	for( j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
+		if( (*j)->occluded( r, tmax ) ) {
+			if( blocker != NULL ) *blocker = *j;
+			return true;
+		}
+	}
+
+	// try the bounded objects, through the structure built by initScene()
+	if( accelerator != NULL )
+		return accelerator->occluded( r, tmax, blocker );
+
+	for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
+		if( (*j)->occluded( r, tmax ) ) {
+			if( blocker != NULL ) *blocker = *j;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+vec3f Scene::transmittance( const ray& r, double tmax, double threshold, Geometry** blocker ) const
+{
+	typedef list<Geometry*>::const_iterator iter;
+	iter j;
+
+	vec3f atten( 1.0, 1.0, 1.0 );
+
+	// try the non-bounded objects
+	for( j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
+		(*j)->attenuate( r, tmax, atten );
+		if( atten[0] <= threshold && atten[1] <= threshold && atten[2] <= threshold ) {
+			if( blocker != NULL ) *blocker = *j;
+			return atten;
+		}
+	}
+
+	// try the bounded objects, through the structure built by initScene()
+	if( accelerator != NULL ) {
+		accelerator->attenuate( r, tmax, threshold, atten, blocker );
+		return atten;
+	}
+
+	for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
+		(*j)->attenuate( r, tmax, atten );
+		if( atten[0] <= threshold && atten[1] <= threshold && atten[2] <= threshold ) {
+			if( blocker != NULL ) *blocker = *j;
+			return atten;
+		}
+	}
+
+	return atten;
+}
+
 void Scene::initScene()
 {
 	bool first_boundedobject = true;
 	BoundingBox b;
 	
 	typedef list<Geometry*>::const_iterator iter;
-	// split the objects into two categories: bounded and non-bounded
+	// split the objects into two categories: bounded and non-bounded; the
+	// transformations may have been changed since the objects were read
 	for( iter j = objects.begin(); j != objects.end(); ++j ) {
+		(*j)->cacheTransform();
 		if( (*j)->hasBoundingBoxCapability() )
 		{
 			boundedobjects.push_back(*j);
@@ -198,4 +501,178 @@ void Scene::initScene()
 		else
 			nonboundedobjects.push_back(*j);
 	}
+
+	// shadow rays can skip attenuating through objects if there are none to
+	// see through
+	transmissive = false;
+	for( iter j = objects.begin(); j != objects.end(); ++j ) {
+		if( (*j)->isTransmissive() ) {
+			transmissive = true;
+			break;
+		}
+	}
+
+	delete light_tree;
+	light_tree = NULL;
+	if( light_samples > 0 ) {
+		light_tree = new LightTree();
+		light_tree->build( lights );
+	}
+
+	// build the structures of the objects and of the geometry they share,
+	// all at the same time, then the one over the bounded objects
+	const chrono::steady_clock::time_point build_start = chrono::steady_clock::now();
+
+	stride_before = stride_after = 0.0;
+	stride_fetches = 0;
+
+	TaskGroup group;
+	for( iter j = objects.begin(); j != objects.end(); ++j ) {
+		Geometry *obj = *j;
+		group.run( [obj]() { obj->buildAccelerator(); } );
+	}
+	for( iter j = shared.begin(); j != shared.end(); ++j ) {
+		Geometry *obj = *j;
+		group.run( [obj]() { obj->buildAccelerator(); } );
+	}
+	group.wait();
+
+	delete accelerator;
+	accelerator = NULL;
+
+	switch( accelerator_method ) {
+	case SCENE_ACCELERATOR_BVH:
+		accelerator = new BVH();
+		break;
+	case SCENE_ACCELERATOR_GRID:
+		accelerator = new Grid();
+		break;
+	case SCENE_ACCELERATOR_WIDEBVH:
+		accelerator = new WideBVH( node_format );
+		break;
+	case SCENE_ACCELERATOR_SBVH: {
+		BVH *bvh = new BVH();
+		bvh->setSpatialSplits( true );
+		accelerator = bvh;
+		break;
+	}
+	default:
+		break;
+	}
+
+	if( accelerator != NULL ) {
+		const vector<Geometry*> objs( boundedobjects.begin(), boundedobjects.end() );
+		if( cache == NULL || !cache->load( *accelerator, objs, false ) ) {
+			accelerator->build( boundedobjects, sceneBounds );
+			if( cache != NULL )
+				cache->store( *accelerator, objs, false );
+		}
+	}
+
+	if( cache != NULL )
+		cache->save();
+
+	build_time = chrono::duration<double>( chrono::steady_clock::now() - build_start ).count();
+}
+
+void Scene::buildLightGrid()
+{
+	delete light_grid;
+	light_grid = NULL;
+
+	if( light_cutoff > 0.0 ) {
+		light_grid = new LightGrid();
+		light_grid->build( lights, light_cutoff );
+	}
+}
+
+bool Scene::update()
+{
+	typedef list<Geometry*>::const_iterator iter;
+
+	const chrono::steady_clock::time_point build_start = chrono::steady_clock::now();
+
+	// the unbounded objects only need their transformations again
+	for( iter j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
+		if( (*j)->getTransform()->hasChanged() )
+			(*j)->cacheTransform();
+	}
+
+	// only the objects under a changed node have moved
+	bool moved = false;
+	for( iter j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
+		if( (*j)->getTransform()->hasChanged() ) {
+			(*j)->cacheTransform();
+			(*j)->ComputeBoundingBox();
+			moved = true;
+		}
+	}
+	transformRoot.clearChanged();
+
+	if( !moved )
+		return false;
+
+	for( iter j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
+		if( j == boundedobjects.begin() )
+			sceneBounds = (*j)->getBoundingBox();
+		else
+			sceneBounds.merge( (*j)->getBoundingBox() );
+	}
+
+	bool rebuilt = false;
+	if( accelerator != NULL && !accelerator->refit() ) {
+		accelerator->build( boundedobjects, sceneBounds );
+		rebuilt = true;
+	}
+
+	build_time = chrono::duration<double>( chrono::steady_clock::now() - build_start ).count();
+	return rebuilt;
+}
+
+bool Scene::getAcceleratorMethod( const string& name, Scene_Accelerator_Method& method )
+{
+	static const char *names[SCENE_ACCELERATOR_MAX] = { "list", "bvh", "grid", "widebvh", "sbvh" };
+
+	for( int k = 0; k < SCENE_ACCELERATOR_MAX; ++k ) {
+		if( name == names[k] ) {
+			method = (Scene_Accelerator_Method)k;
+			return true;
+		}
+	}
+	return false;
+}
+
+void Scene::setCacheFile( const string& path )
+{
+	if( cache == NULL )
+		cache = new AcceleratorCache();
+	cache->open( path );
+}
+
+void Scene::getVertexStride( double& before, double& after ) const
+{
+	before = stride_fetches ? stride_before / stride_fetches : 0.0;
+	after = stride_fetches ? stride_after / stride_fetches : 0.0;
+}
+
+// the meshes are built at the same time
+void Scene::addVertexStride( double before, double after, size_t count )
+{
+	lock_guard<mutex> guard( stride_lock );
+	stride_before += before;
+	stride_after += after;
+	stride_fetches += count;
+}
+
+bool Scene::getNodeFormat( const string& name, Scene_Node_Format& format )
+{
+	static const char *names[SCENE_NODE_MAX] = { "float", "quantized16", "quantized8" };
+
+	for( int k = 0; k < SCENE_NODE_MAX; ++k ) {
+		if( name == names[k] ) {
+			format = (Scene_Node_Format)k;
+			return true;
+		}
+	}
+	return false;
 }
@@ -10,6 +10,7 @@
 
 #include <list>
 #include <algorithm>
+#include <mutex>
 
 
 using namespace std;
@@ -24,6 +25,10 @@ using namespace std;
 class Scene;
 class Light;
 class AmbientLight;
+class Accelerator;
+class AcceleratorCache;
+class LightTree;
+class LightGrid;
 
 class SceneElement {
 public:
@@ -56,6 +61,12 @@ public:
 	// closest to the origin in tMin and the "t" value of the far intersection
 	// in tMax and return true, else return false.
 	bool intersect(const ray& r, double& tMin, double& tMax) const;
+
+	// grow this bounding box so that it also encloses the target
+	void merge(const BoundingBox& target);
+
+	// surface area of the box, as used by the surface area heuristic
+	double area() const;
 };
 
 
@@ -67,6 +78,13 @@ protected:
 	mat4f    inverse;
 	mat3f    normi;
 
+    // the transformation relative to the parent, which xform combines with
+    // the parent's
+    mat4f    local;
+
+    // set when the transformation changes after construction
+    bool     changed;
+
     // information about parent & children
     TransformNode *parent;
     list<TransformNode*> children;
@@ -87,6 +105,31 @@ public:
         children.push_back(child);
         return child;
     }
+
+    child_citer beginChildren() const { return children.begin(); }
+    child_citer endChildren() const { return children.end(); }
+
+    // Replace the transformation relative to the parent; the nodes below
+    // follow.  The objects under the node keep their old bounds until
+    // Scene::update() is called.
+    void setXform(const mat4f& xform)
+    {
+        local = xform;
+        update();
+    }
+
+    const mat4f& getXform() const { return local; }
+
+    // has the transformation of this node changed since the last
+    // clearChanged()?
+    bool hasChanged() const { return changed; }
+
+    void clearChanged()
+    {
+        changed = false;
+        for(child_iter c = children.begin(); c != children.end(); ++c )
+            (*c)->clearChanged();
+    }
     
     // Coordinate-Space transformation
     vec3f globalToLocalCoords(const vec3f &v)
@@ -109,6 +152,12 @@ public:
         return (normi * v).normalize();
     }
 
+    const mat4f& getInverse() const { return inverse; }
+
+    // the matrix that localToGlobalCoordsNormal() applies before it
+    // normalizes, for normals that are still to be interpolated
+    const mat3f& getNormalMatrix() const { return normi; }
+
 protected:
     // protected so that users can't directly construct one of these...
     // force them to use the createChild() method.  Note that they CAN
@@ -117,6 +166,7 @@ protected:
         : children()
     {
         this->parent = parent;
+        local = xform;
         if (parent == NULL)
             this->xform = xform;
         else
@@ -124,6 +174,23 @@ protected:
         
         inverse = this->xform.inverse();
         normi = this->xform.upper33().inverse().transpose();
+        changed = false;
+    }
+
+    // recompute the matrices of this node and of those below it
+    void update()
+    {
+        if (parent == NULL)
+            xform = local;
+        else
+            xform = parent->xform * local;
+
+        inverse = xform.inverse();
+        normi = xform.upper33().inverse().transpose();
+        changed = true;
+
+        for(child_iter c = children.begin(); c != children.end(); ++c )
+            (*c)->update();
     }
 };
 
@@ -135,6 +202,111 @@ public:
 };
 
 
+// The global-to-local transformation of an object, kept with the object as
+// the 3x4 affine matrix that it always is.  What kind of transformation it
+// is gets worked out once, so that the common kinds cost less per ray: the
+// identity costs nothing, a translation a subtraction, and a rotation with
+// a uniform scale needs no normalization, as the scale is known.
+class LocalTransform {
+public:
+	enum Kind {
+		IDENTITY,
+		TRANSLATE,
+		UNIFORM,		// rotation and uniform scale, then translation
+		GENERAL
+	};
+
+	LocalTransform()
+		: kind( IDENTITY ), scale( 1.0 ), inv_scale( 1.0 )
+	{
+		m[0] = vec4f( 1.0, 0.0, 0.0, 0.0 );
+		m[1] = vec4f( 0.0, 1.0, 0.0, 0.0 );
+		m[2] = vec4f( 0.0, 0.0, 1.0, 0.0 );
+	}
+
+	// take the transformation from the inverse of an object's matrix
+	void set( const mat4f& inverse );
+
+	Kind getKind() const { return kind; }
+
+	// Put r in local coordinates into local, with a unit direction as the
+	// objects expect, and return the local length of a unit of global
+	// distance along r, by which t has to be divided on the way back.  The
+	// direction of r must be of unit length, as the tracer makes them.
+	double toLocal( const ray& r, ray& local ) const
+	{
+		const vec3f& p = r.getPosition();
+		const vec3f& d = r.getDirection();
+
+		switch( kind ) {
+		case IDENTITY:
+			local = r;
+			return 1.0;
+
+		case TRANSLATE:
+			local = ray( vec3f( p[0] + m[0][3], p[1] + m[1][3], p[2] + m[2][3] ), d );
+			return 1.0;
+
+		case UNIFORM:
+			local = ray( point( p ), linear( d ) * inv_scale );
+			return scale;
+
+		default: {
+			vec3f dir = linear( d );
+			const double length = dir.length();
+			local = ray( point( p ), dir / length );
+			return length;
+		}
+		}
+	}
+
+	// a unit normal in local coordinates, in global ones
+	vec3f normalToGlobal( const vec3f& N ) const
+	{
+		switch( kind ) {
+		case IDENTITY:
+		case TRANSLATE:
+			return N;
+
+		case UNIFORM:
+			return transposed( N ) * inv_scale;
+
+		default:
+			return transposed( N ).normalize();
+		}
+	}
+
+private:
+	vec3f point( const vec3f& p ) const
+	{
+		return vec3f( m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+			m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+			m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3] );
+	}
+
+	vec3f linear( const vec3f& d ) const
+	{
+		return vec3f( m[0][0]*d[0] + m[0][1]*d[1] + m[0][2]*d[2],
+			m[1][0]*d[0] + m[1][1]*d[1] + m[1][2]*d[2],
+			m[2][0]*d[0] + m[2][1]*d[1] + m[2][2]*d[2] );
+	}
+
+	// normals go back through the inverse transpose of the local-to-global
+	// matrix, which is the transpose of this one
+	vec3f transposed( const vec3f& N ) const
+	{
+		return vec3f( m[0][0]*N[0] + m[1][0]*N[1] + m[2][0]*N[2],
+			m[0][1]*N[0] + m[1][1]*N[1] + m[2][1]*N[2],
+			m[0][2]*N[0] + m[1][2]*N[1] + m[2][2]*N[2] );
+	}
+
+	vec4f	m[3];			// the rows of the matrix
+	Kind	kind;
+	double	scale;			// of a uniform transformation,
+	double	inv_scale;		// and its inverse
+};
+
+
 // A Geometry object is anything that has extent in three dimensions.
 // It may not be an actual visible scene object.  For example, hierarchical
 // spatial subdivision could be expressed in terms of Geometry instances.
@@ -147,6 +319,37 @@ public:
     // do not call directly - this should only be called by intersect()
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
 
+    // intersect a packet of up to RAY_PACKET_SIZE rays with the object in
+    // the global coordinate space.  i[k] is only replaced by a hit of r[k]
+    // nearer than it, where an isect without an object is no hit yet.  By
+    // default, each ray goes through intersect() on its own.
+    virtual void intersectPacket( int count, const ray* const* r, isect* const* i ) const;
+
+    // shadow query: does an opaque part of the object block the ray before
+    // tMax?  Unlike intersect(), no normal or material is computed for the
+    // caller, so this is the cheaper way to ask.
+    virtual bool occluded(const ray& r, double tMax) const;
+
+    // the same in the object's local coordinate space
+    // do not call directly - this should only be called by occluded()
+    virtual bool occludedLocal( const ray& r, double tMax ) const;
+
+    // shadow query through transmissive objects: multiply atten by the kt of
+    // every surface of the object that the ray crosses before tMax
+    virtual void attenuate(const ray& r, double tMax, vec3f& atten) const;
+
+    // the same in the object's local coordinate space
+    // do not call directly - this should only be called by attenuate()
+    virtual void attenuateLocal( const ray& r, double tMax, vec3f& atten ) const;
+
+    // build whatever structure the object uses to speed up its own
+    // intersections; Scene::initScene() calls this once, possibly on
+    // several objects at the same time
+    virtual void buildAccelerator() {}
+
+    // does any part of the object let light through?
+    virtual bool isTransmissive() const { return false; }
+
 
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox& getBoundingBox() const { return bounds; }
@@ -195,14 +398,26 @@ public:
     // this should be overridden if hasBoundingBoxCapability() is true.
     virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
 
-    void setTransform(TransformNode *transform) { this->transform = transform; };
+    // World-space bounds of the part of the object between lo and hi along
+    // axis, for spatial splits.  By default the local bounding box is
+    // transformed and cut as a solid, which for a long, rotated object is
+    // far tighter than cutting its world-space box.
+    virtual BoundingBox ComputeClippedBoundingBox(int axis, double lo, double hi);
+
+    void setTransform(TransformNode *transform) { this->transform = transform; cacheTransform(); };
+    TransformNode *getTransform() const { return transform; }
+
+    // take a new copy of the transformation into local space that the
+    // intersections use, after the transformation has changed
+    void cacheTransform() { local_transform.set( transform->getInverse() ); }
     
 	Geometry( Scene *scene ) 
-		: SceneElement( scene ) {}
+		: SceneElement( scene ), transform( NULL ) {}
 
 protected:
 	BoundingBox bounds;
     TransformNode *transform;
+    LocalTransform local_transform;
 };
 
 
@@ -215,6 +430,8 @@ public:
 	virtual const Material& getMaterial() const = 0;
 	virtual void setMaterial( Material *m ) = 0;
 
+	virtual bool isTransmissive() const { return !getMaterial().kt.iszero(); }
+
 protected:
 	SceneObject( Scene *scene )
 		: Geometry( scene ) {}
@@ -240,6 +457,29 @@ protected:
 };
 
 
+// The structures Scene::intersect() can use to find the bounded objects
+// that a ray hits.
+enum Scene_Accelerator_Method {
+	SCENE_ACCELERATOR_LIST = 0,		// test every object in turn
+	SCENE_ACCELERATOR_BVH,
+	SCENE_ACCELERATOR_GRID,
+	SCENE_ACCELERATOR_WIDEBVH,		// BVH with SIMD-tested wide nodes
+	SCENE_ACCELERATOR_SBVH,			// BVH with spatial splits
+	SCENE_ACCELERATOR_MAX
+};
+
+
+// How the nodes of the wide BVHs (the widebvh accelerator and the face
+// hierarchies of meshes) store the bounds of their children.  The
+// quantized formats save memory at the cost of slightly looser boxes.
+enum Scene_Node_Format {
+	SCENE_NODE_FLOAT = 0,
+	SCENE_NODE_16BIT,				// 16 bit steps relative to the parent
+	SCENE_NODE_8BIT,				// 8 bit steps relative to the parent
+	SCENE_NODE_MAX
+};
+
+
 class Scene {
 public:
 	typedef list<Light*>::iterator 			liter;
@@ -252,7 +492,11 @@ public:
 
 public:
 	Scene() 
-		: transformRoot(), objects(), lights() {}
+		: transformRoot(), objects(), lights(),
+		  accelerator_method( SCENE_ACCELERATOR_BVH ), node_format( SCENE_NODE_FLOAT ), accelerator( NULL ), cache( NULL ),
+		  light_samples( 0 ), light_tree( NULL ), light_cutoff( 0.0 ), light_grid( NULL ),
+		  mesh_reordering( false ), stride_before( 0.0 ), stride_after( 0.0 ), stride_fetches( 0 ),
+		  transmissive( false ), build_time( 0.0 ) {}
 	virtual ~Scene();
 
 	void add(Geometry* obj) {
@@ -264,6 +508,14 @@ public:
 		lights.push_back( light );
 	}
 
+	// Geometry that objects of the scene are made of without being in it
+	// themselves, such as a mesh placed several times: initScene() builds
+	// its structures along with those of the objects, and the scene
+	// deletes it.
+	void addShared(Geometry* obj) {
+		shared.push_back( obj );
+	}
+
 	void add(AmbientLight* light) {
 		ambient_lights.push_back(light);
 	}
@@ -271,11 +523,113 @@ public:
 	bool intersect( const ray& r, isect& i ) const;
 	void initScene();
 
+	// Bring the scene up to date after TransformNode::setXform(): the
+	// objects under the changed nodes get new bounds, and the acceleration
+	// structure is refitted to them.  It is only rebuilt if the refit
+	// degraded it too much, or if it cannot be refitted; returns true if it
+	// was rebuilt.
+	bool update();
+
+	// Closest hits of up to RAY_PACKET_SIZE rays, found together: i[k] is
+	// filled in as intersect( *r[k], *i[k] ) would, and left without an
+	// object if r[k] hits nothing.
+	void intersectPacket( int count, const ray* const* r, isect* const* i ) const;
+
+	// The same for camera rays that all lie within frustum: the bounded
+	// objects outside it cannot be hit, and the list and the BVHs do not
+	// try them.
+	void intersectPacket( int count, const ray* const* r, isect* const* i, const Frustum& frustum ) const;
+
+	// Is there an opaque object along r before tmax?  Stops at the first
+	// one found, whichever it is, so use it for shadow rays rather than
+	// intersect().  Transmissive objects never block.  The object found is
+	// put in blocker if given, for the caller to try first next time.
+	bool occluded( const ray& r, double tmax, Geometry** blocker = NULL ) const;
+
+	// How much light gets through the objects along r before tmax: the
+	// product of the kt of every surface crossed.  The objects are found in
+	// a single traversal, and the search stops as soon as every component
+	// is at or below threshold, in which case the product so far is
+	// returned, and the object that took it there is put in blocker if given.
+	vec3f transmittance( const ray& r, double tmax, double threshold, Geometry** blocker = NULL ) const;
+
+	// wall-clock seconds that initScene() spent building the objects'
+	// structures and the scene's own, or that the last update() that moved
+	// anything spent refitting or rebuilding
+	double getBuildTime() const { return build_time; }
+
+	// whether any object lets light through, as found by initScene();
+	// if none does, occluded() alone settles every shadow ray
+	bool hasTransmissiveObjects() const { return transmissive; }
+
+	// accelerator
+	// takes effect at the next initScene()
+	void						setAcceleratorMethod(Scene_Accelerator_Method method) { accelerator_method = method; }
+	Scene_Accelerator_Method	getAcceleratorMethod() const { return accelerator_method; }
+
+	// accelerator names as written in scene files and on the command line:
+	// "list", "bvh", "grid", "widebvh" and "sbvh".  Returns false if the name
+	// is unknown.
+	static bool getAcceleratorMethod(const string& name, Scene_Accelerator_Method& method);
+
+	// takes effect at the next initScene()
+	void				setNodeFormat(Scene_Node_Format format) { node_format = format; }
+	Scene_Node_Format	getNodeFormat() const { return node_format; }
+
+	// node format names: "float", "quantized16" and "quantized8".  Returns
+	// false if the name is unknown.
+	static bool getNodeFormat(const string& name, Scene_Node_Format& format);
+
+	// Keep the built acceleration structures, the scene's and the objects'
+	// own, in the file at path, and take them from there when the objects
+	// have not changed since; takes effect at the next initScene().
+	void				setCacheFile(const string& path);
+	AcceleratorCache	*getAcceleratorCache() const { return cache; }
+
+	// Sort the faces of every mesh along a Morton curve and number its
+	// vertices in the order the faces first use them, so that neighbouring
+	// faces fetch neighbouring vertices; takes effect at the next
+	// initScene().
+	void				setMeshReordering(bool enable) { mesh_reordering = enable; }
+	bool				getMeshReordering() const { return mesh_reordering; }
+
+	// The average distance in bytes from one vertex fetched by the faces of
+	// a mesh to the next, over the meshes initScene() reordered: as they
+	// were loaded, and as reordered.  Both 0 if none was.
+	void				getVertexStride(double& before, double& after) const;
+
+	// for the meshes to report theirs, as totals over count fetches
+	void				addVertexStride(double before, double after, size_t count);
+
 	// light
 	list<Light*>::const_iterator	beginLights()		const { return lights.begin(); }
 	list<Light*>::const_iterator	endLights()			const { return lights.end(); }
 	const list<Light*>				getLights()			const { return lights; }
 	const list<AmbientLight*>		getAmbientLights()	const { return ambient_lights;  }
+
+	// With n > 0, every point is shaded with n point lights picked from a
+	// tree over them, in proportion to what each is likely to give, rather
+	// than with all of them; 0 for all of them.  Takes effect at the next
+	// initScene(), which builds the tree.
+	void				setLightSamples(int n) { light_samples = n; }
+	int					getLightSamples() const { return light_samples; }
+
+	// the tree over the lights, or NULL if they are not sampled
+	const LightTree		*getLightTree() const { return light_tree; }
+
+	// With cutoff > 0, a point light is left out wherever no component of
+	// its attenuated colour is as much as cutoff, which the point lights
+	// are sorted into a grid by; 0 to shade with every light everywhere.
+	// Takes effect at the next buildLightGrid().
+	void				setLightCutoff(double cutoff) { light_cutoff = cutoff; }
+	double				getLightCutoff() const { return light_cutoff; }
+
+	// Sort the lights into the grid, by the distance attenuation in effect
+	// now, which the UI can change between renders.
+	void				buildLightGrid();
+
+	// the grid of the lights, or NULL without a cutoff
+	const LightGrid		*getLightGrid() const { return light_grid; }
         
 	Camera *getCamera() { return &camera; }
 
@@ -283,6 +637,7 @@ private:
     list<Geometry*>		objects;
 	list<Geometry*>		nonboundedobjects;
 	list<Geometry*>		boundedobjects;
+	list<Geometry*>		shared;
     list<Light*>		lights;
 	list<AmbientLight*> ambient_lights;
 
@@ -292,6 +647,30 @@ private:
 	// must fall within this bounding box.  Objects that don't have hasBoundingBoxCapability()
 	// are exempt from this requirement.
 	BoundingBox sceneBounds;
+
+	// acceleration structure over boundedobjects, built by initScene();
+	// NULL for the plain list
+	Scene_Accelerator_Method	accelerator_method;
+	Scene_Node_Format			node_format;
+	Accelerator					*accelerator;
+	AcceleratorCache			*cache;
+
+	int							light_samples;
+	LightTree					*light_tree;
+
+	double						light_cutoff;
+	LightGrid					*light_grid;
+
+	bool						mesh_reordering;
+	double						stride_before;		// totals over stride_fetches
+	double						stride_after;
+	size_t						stride_fetches;
+	mutex						stride_lock;
+
+	// some object has a transmissive material
+	bool transmissive;
+
+	double build_time;
 };
 
 #endif // __SCENE_H__
@@ -0,0 +1,134 @@
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "tasks.h"
+
+
+// Data Structure
+// The worker threads and the queue of tasks they share.  It is created on
+// first use and stops its workers when the program exits.
+class TaskPool {
+public:
+	struct Task {
+		std::function<void()>	work;
+		TaskGroup*				group;
+	};
+
+	static TaskPool& instance()
+	{
+		static TaskPool pool;
+		return pool;
+	}
+
+	int getThreadCount() const { return (int)workers.size() + 1; }
+
+	void push( const Task& task )
+	{
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			queue.push_back( task );
+		}
+		has_work.notify_one();
+	}
+
+	// run queued tasks until the group is done
+	void wait( TaskGroup& group )
+	{
+		std::unique_lock<std::mutex> lock( mutex );
+		while( group.pending > 0 ) {
+			if( !queue.empty() ) {
+				execute( lock );
+				continue;
+			}
+			task_done.wait( lock, [&]{ return group.pending == 0 || !queue.empty(); } );
+		}
+	}
+
+private:
+	TaskPool()
+		: stopping( false )
+	{
+		const int cores = (int)std::thread::hardware_concurrency();
+		for( int k = 1; k < cores; ++k )
+			workers.push_back( std::thread( &TaskPool::work, this ) );
+	}
+
+	~TaskPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			stopping = true;
+		}
+		has_work.notify_all();
+
+		for( size_t k = 0; k < workers.size(); ++k )
+			workers[k].join();
+	}
+
+	void work()
+	{
+		std::unique_lock<std::mutex> lock( mutex );
+		while( true ) {
+			has_work.wait( lock, [&]{ return stopping || !queue.empty(); } );
+			if( stopping ) return;
+			execute( lock );
+		}
+	}
+
+	// pop the oldest task and run it with the lock released
+	void execute( std::unique_lock<std::mutex>& lock )
+	{
+		Task task = queue.front();
+		queue.pop_front();
+
+		lock.unlock();
+		task.work();
+		lock.lock();
+
+		--task.group->pending;
+		task_done.notify_all();
+	}
+
+	std::mutex					mutex;
+	std::condition_variable		has_work;
+	std::condition_variable		task_done;
+	std::deque<Task>			queue;
+	std::vector<std::thread>	workers;
+	bool						stopping;
+};
+
+
+// Operation Handling
+void TaskGroup::run( const std::function<void()>& task )
+{
+	TaskPool& pool = TaskPool::instance();
+
+	// without workers there is no point in queueing
+	if( pool.getThreadCount() == 1 ) {
+		task();
+		return;
+	}
+
+	++pending;
+
+	TaskPool::Task entry;
+	entry.work	= task;
+	entry.group	= this;
+	pool.push( entry );
+}
+
+
+void TaskGroup::wait()
+{
+	if( pending > 0 )
+		TaskPool::instance().wait( *this );
+}
+
+
+int TaskGroup::getThreadCount()
+{
+	return TaskPool::instance().getThreadCount();
+}
@@ -0,0 +1,46 @@
+//
+// tasks.h
+//
+// A minimal task system: work is queued on a pool of worker threads, one
+// per core, shared by the whole program.  Tasks are grouped so that the
+// code that spawned them can wait for just its own; a thread waiting on a
+// group runs queued tasks meanwhile, so tasks may spawn and wait on tasks
+// of their own without tying up the pool.
+//
+
+#ifndef __TASKS_H__
+#define __TASKS_H__
+
+
+#include <atomic>
+#include <functional>
+
+
+class TaskGroup {
+public:
+	TaskGroup()
+		: pending( 0 ) {}
+
+	// all the tasks of a group must be done before it goes away
+	~TaskGroup() { wait(); }
+
+	// queue the task to run on some thread, possibly the calling one
+	void run( const std::function<void()>& task );
+
+	// return once every task of the group is done
+	void wait();
+
+	// number of threads that may run tasks, the waiting one included
+	static int getThreadCount();
+
+private:
+	friend class TaskPool;
+
+	std::atomic<int> pending;
+
+	TaskGroup( const TaskGroup& );
+	TaskGroup& operator =( const TaskGroup& );
+};
+
+
+#endif // __TASKS_H__
@@ -0,0 +1,793 @@
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+#include "widebvh.h"
+
+#if defined(WIDEBVH_AVX)
+#include <immintrin.h>
+#elif defined(WIDEBVH_SSE)
+#include <emmintrin.h>
+#endif
+
+
+// Static Function Prototype
+static float WideBVH_roundDown(double v);
+static float WideBVH_roundUp(double v);
+static float WideBVH_padding(const BoundingBox& root);
+
+
+// Operation Handling
+void WideBVH::clear()
+{
+	BVH::clear();
+	wide_nodes.clear();
+	wide_nodes16.clear();
+	wide_nodes8.clear();
+}
+
+
+void WideBVH::build( const list<Geometry*>& objs, const BoundingBox& bounds )
+{
+	clear();
+	BVH::build(objs, bounds);
+	collapse();
+}
+
+
+void WideBVH::buildLocal( const vector<Geometry*>& objs )
+{
+	clear();
+	BVH::buildLocal(objs);
+	collapse();
+}
+
+
+void WideBVH::buildPrimitives( const vector<BoundingBox>& bounds )
+{
+	clear();
+	BVH::buildPrimitives(bounds);
+	collapse();
+}
+
+
+void WideBVH::collapse()
+{
+	if (nodes.empty()) return;
+
+	const BoundingBox& root = nodes[0].bounds;
+	pad = WideBVH_padding(root);
+
+	// n binary nodes never need more than n wide ones
+	wide_nodes.reserve(nodes.size());
+
+	if (nodes[0].count > 0) {
+		// the whole tree is one leaf: give it a root of its own
+		WideNode node;
+		node.valid		= 1;
+		node.child[0]	= nodes[0].offset;
+		node.count[0]	= nodes[0].count;
+		for (int axis = 0; axis < 3; ++axis) {
+			node.box_min[axis][0] = WideBVH_roundDown(root.min[axis]) - pad;
+			node.box_max[axis][0] = WideBVH_roundUp(root.max[axis]) + pad;
+		}
+		wide_nodes.push_back(node);
+	} else {
+		collapseNode(0);
+	}
+
+	// the binary nodes are not needed any more
+	vector<Node>().swap(nodes);
+	build_cost = cost();
+
+	switch (node_format) {
+	case SCENE_NODE_16BIT:
+		quantize(wide_nodes16);
+		break;
+	case SCENE_NODE_8BIT:
+		quantize(wide_nodes8);
+		break;
+	default:
+		break;
+	}
+}
+
+
+// Collapse the interior binary node at index and the levels below it into
+// one wide node, and return the index of that node.  The children are
+// opened largest area first until there are WIDTH of them or only leaves
+// are left.
+int WideBVH::collapseNode( int index )
+{
+	int slots[WIDTH];
+	int num_slots = 2;
+	slots[0] = index + 1;
+	slots[1] = nodes[index].offset;
+
+	while (num_slots < WIDTH) {
+		int		open		= -1;
+		double	area_best	= -1.0;
+		for (int k = 0; k < num_slots; ++k) {
+			const Node& child = nodes[slots[k]];
+			if (child.count == 0 && child.bounds.area() > area_best) {
+				open		= k;
+				area_best	= child.bounds.area();
+			}
+		}
+		if (open < 0) break;
+
+		const int opened = slots[open];
+		slots[open]				= opened + 1;
+		slots[num_slots++]		= nodes[opened].offset;
+	}
+
+	const int wide_index = (int)wide_nodes.size();
+	wide_nodes.push_back(WideNode());
+	wide_nodes[wide_index].valid = (1 << num_slots) - 1;
+
+	for (int k = 0; k < WIDTH; ++k) {
+		WideNode& node = wide_nodes[wide_index];
+
+		if (k >= num_slots) {
+			// unused slot: never hit, as it is also masked out by valid
+			for (int axis = 0; axis < 3; ++axis) {
+				node.box_min[axis][k] = FLT_MAX;
+				node.box_max[axis][k] = -FLT_MAX;
+			}
+			node.child[k] = 0;
+			node.count[k] = 0;
+			continue;
+		}
+
+		const Node& child = nodes[slots[k]];
+		for (int axis = 0; axis < 3; ++axis) {
+			node.box_min[axis][k] = WideBVH_roundDown(child.bounds.min[axis]) - pad;
+			node.box_max[axis][k] = WideBVH_roundUp(child.bounds.max[axis]) + pad;
+		}
+		node.count[k] = child.count;
+		node.child[k] = child.offset;
+	}
+
+	// the subtrees go after this node; wide_nodes may grow meanwhile, so
+	// the node is looked up again for every child
+	for (int k = 0; k < num_slots; ++k) {
+		if (nodes[slots[k]].count == 0) {
+			const int child = collapseNode(slots[k]);
+			wide_nodes[wide_index].child[k] = child;
+		}
+	}
+
+	return wide_index;
+}
+
+
+// The exact bounds of every slot are gathered first, children before
+// their parents as in BVH::refit(), so that the padding can follow the
+// new extent of the tree; then they are rounded as in collapse().
+bool WideBVH::refit()
+{
+	if (node_format != SCENE_NODE_FLOAT || !primitives.empty()) return false;
+	if (wide_nodes.empty()) return true;
+
+	vector<BoundingBox> slots(wide_nodes.size() * WIDTH);
+	for (int n = (int)wide_nodes.size() - 1; n >= 0; --n) {
+		const WideNode& node = wide_nodes[n];
+
+		for (int k = 0; k < WIDTH; ++k) {
+			if (!(node.valid & (1 << k))) continue;
+
+			BoundingBox& bounds = slots[n * WIDTH + k];
+			if (node.count[k] > 0) {
+				bounds = objectBounds(objects[node.child[k]]);
+				for (int o = node.child[k] + 1; o < node.child[k] + node.count[k]; ++o) {
+					bounds.merge(objectBounds(objects[o]));
+				}
+				continue;
+			}
+
+			const WideNode& child = wide_nodes[node.child[k]];
+			bool first = true;
+			for (int j = 0; j < WIDTH; ++j) {
+				if (!(child.valid & (1 << j))) continue;
+				if (first) bounds = slots[node.child[k] * WIDTH + j];
+				else bounds.merge(slots[node.child[k] * WIDTH + j]);
+				first = false;
+			}
+		}
+	}
+
+	BoundingBox root;
+	bool first = true;
+	for (int k = 0; k < WIDTH; ++k) {
+		if (!(wide_nodes[0].valid & (1 << k))) continue;
+		if (first) root = slots[k];
+		else root.merge(slots[k]);
+		first = false;
+	}
+	pad = WideBVH_padding(root);
+
+	for (size_t n = 0; n < wide_nodes.size(); ++n) {
+		WideNode& node = wide_nodes[n];
+		for (int k = 0; k < WIDTH; ++k) {
+			if (!(node.valid & (1 << k))) continue;
+
+			const BoundingBox& bounds = slots[n * WIDTH + k];
+			for (int axis = 0; axis < 3; ++axis) {
+				node.box_min[axis][k] = WideBVH_roundDown(bounds.min[axis]) - pad;
+				node.box_max[axis][k] = WideBVH_roundUp(bounds.max[axis]) + pad;
+			}
+		}
+	}
+
+	return refitCostOK(cost());
+}
+
+
+double WideBVH::cost() const
+{
+	if (wide_nodes.empty()) return 0.0;
+
+	BoundingBox root;
+	bool first = true;
+	double sum = 0.0;
+	for (size_t n = 0; n < wide_nodes.size(); ++n) {
+		const WideNode& node = wide_nodes[n];
+		for (int k = 0; k < WIDTH; ++k) {
+			if (!(node.valid & (1 << k))) continue;
+
+			const BoundingBox bounds = slotBounds(node, k);
+			sum += nodeCost(bounds.area(), node.count[k]);
+
+			if (n > 0) continue;
+			if (first) root = bounds;
+			else root.merge(bounds);
+			first = false;
+		}
+	}
+
+	const double root_area = root.area();
+	return root_area > 0.0 ? sum / root_area : sum;
+}
+
+
+BoundingBox WideBVH::slotBounds( const WideNode& node, int k )
+{
+	BoundingBox bounds;
+	for (int axis = 0; axis < 3; ++axis) {
+		bounds.min[axis] = node.box_min[axis][k];
+		bounds.max[axis] = node.box_max[axis][k];
+	}
+	return bounds;
+}
+
+
+// The binary part (objects and flags) comes first, then the nodes in the
+// format in use; the width and format must match this build's.
+bool WideBVH::write( vector<char>& out, const vector<Geometry*>& objs ) const
+{
+	const int header[4] = { 'W' | 'B' << 8 | 'V' << 16 | 'H' << 24, WIDTH, (int)node_format, (int)sizeof(WideNode) };
+	put(out, header, 4);
+	if (!BVH::write(out, objs)) return false;
+
+	put(out, &pad, 1);
+	putVector(out, wide_nodes);
+	putVector(out, wide_nodes16);
+	putVector(out, wide_nodes8);
+	return true;
+}
+
+
+bool WideBVH::read( const char*& data, const char* end, const vector<Geometry*>& objs )
+{
+	clear();
+
+	int header[4];
+	if (!get(data, end, header, 4)) return false;
+	if (header[0] != ('W' | 'B' << 8 | 'V' << 16 | 'H' << 24) || header[1] != WIDTH ||
+		header[2] != (int)node_format || header[3] != (int)sizeof(WideNode))
+		return false;
+
+	if (!BVH::read(data, end, objs) ||
+		!get(data, end, &pad, 1) ||
+		!getVector(data, end, wide_nodes) ||
+		!getVector(data, end, wide_nodes16) ||
+		!getVector(data, end, wide_nodes8))
+		return false;
+
+	// the traversal only looks at the nodes of node_format
+	switch (node_format) {
+	case SCENE_NODE_16BIT:
+		return wide_nodes.empty() && wide_nodes8.empty() && checkWideTree(wide_nodes16);
+	case SCENE_NODE_8BIT:
+		return wide_nodes.empty() && wide_nodes16.empty() && checkWideTree(wide_nodes8);
+	default:
+		return wide_nodes16.empty() && wide_nodes8.empty() && checkWideTree(wide_nodes);
+	}
+}
+
+
+template<typename NodeType>
+bool WideBVH::checkWideTree( const vector<NodeType>& tree ) const
+{
+	const int items = numItems();
+	const int count = (int)tree.size();
+	vector<int> depth(count, 0);
+	vector<bool> covered(items, false);
+
+	for (int n = 0; n < count; ++n) {
+		const NodeType& node = tree[n];
+		if (node.valid < 0 || node.valid >= (1 << WIDTH) || depth[n] >= MAX_DEPTH) return false;
+
+		for (int k = 0; k < WIDTH; ++k) {
+			if (!(node.valid & (1 << k))) continue;
+
+			const int child = node.child[k];
+			if (node.count[k] < 0) return false;
+			if (node.count[k] > 0) {
+				if (child < 0 || child > items - node.count[k]) return false;
+				for (int j = child; j < child + node.count[k]; ++j) {
+					if (covered[j]) return false;
+					covered[j] = true;
+				}
+				continue;
+			}
+
+			if (child <= n || child >= count) return false;
+			depth[child] = max(depth[child], depth[n] + 1);
+		}
+	}
+	return true;
+}
+
+
+// Each node gets a grid from the low corner of its children's union to the
+// high one, in as many steps as Q can count; the steps of a child's box are
+// rounded outwards, and checked against the float sums the traversal will
+// compute, so the decoded box always contains the float one.
+template<typename Q>
+void WideBVH::quantize( vector< QuantizedNode<Q> >& out )
+{
+	const int levels = numeric_limits<Q>::max();
+
+	out.resize(wide_nodes.size());
+	for (size_t n = 0; n < wide_nodes.size(); ++n) {
+		const WideNode&		node	= wide_nodes[n];
+		QuantizedNode<Q>&	qnode	= out[n];
+
+		qnode.valid = node.valid;
+		for (int k = 0; k < WIDTH; ++k) {
+			qnode.child[k] = node.child[k];
+			qnode.count[k] = node.count[k];
+		}
+
+		for (int axis = 0; axis < 3; ++axis) {
+			float lo = FLT_MAX;
+			float hi = -FLT_MAX;
+			for (int k = 0; k < WIDTH; ++k) {
+				if (!(node.valid & (1 << k))) continue;
+				lo = min(lo, node.box_min[axis][k]);
+				hi = max(hi, node.box_max[axis][k]);
+			}
+
+			float scale = WideBVH_roundUp(((double)hi - (double)lo) / levels);
+			while (lo + (float)levels * scale < hi) {
+				scale = nextafterf(scale, FLT_MAX);
+			}
+			qnode.origin[axis]	= lo;
+			qnode.scale[axis]	= scale;
+
+			for (int k = 0; k < WIDTH; ++k) {
+				if (!(node.valid & (1 << k))) {
+					// unused slot: an empty box
+					qnode.q_min[axis][k] = (Q)levels;
+					qnode.q_max[axis][k] = 0;
+					continue;
+				}
+
+				int q_lo = 0;
+				int q_hi = levels;
+				if (scale > 0.0f) {
+					q_lo = max(0, min(levels, (int)floor((node.box_min[axis][k] - lo) / scale)));
+					q_hi = max(0, min(levels, (int)ceil((node.box_max[axis][k] - lo) / scale)));
+				}
+				while (q_lo > 0 && lo + (float)q_lo * scale > node.box_min[axis][k]) {
+					--q_lo;
+				}
+				while (q_hi < levels && lo + (float)q_hi * scale < node.box_max[axis][k]) {
+					++q_hi;
+				}
+				qnode.q_min[axis][k] = (Q)q_lo;
+				qnode.q_max[axis][k] = (Q)q_hi;
+			}
+		}
+	}
+
+	vector<WideNode>().swap(wide_nodes);
+}
+
+
+// decode the boxes and test them as usual
+template<typename Q>
+const WideBVH::WideNode& WideBVH::decode( const QuantizedNode<Q>& node, WideNode& scratch )
+{
+	for (int axis = 0; axis < 3; ++axis) {
+		for (int k = 0; k < WIDTH; ++k) {
+			scratch.box_min[axis][k] = node.origin[axis] + (float)node.q_min[axis][k] * node.scale[axis];
+			scratch.box_max[axis][k] = node.origin[axis] + (float)node.q_max[axis][k] * node.scale[axis];
+		}
+	}
+	for (int k = 0; k < WIDTH; ++k) {
+		scratch.child[k] = node.child[k];
+		scratch.count[k] = node.count[k];
+	}
+	scratch.valid = node.valid;
+	return scratch;
+}
+
+
+template<typename Q>
+int WideBVH::intersectNode( const QuantizedNode<Q>& node, const RayData& data, float tMax, float t_near[WIDTH] )
+{
+	WideNode scratch;
+	return intersectNode(decode(node, scratch), data, tMax, t_near);
+}
+
+
+int WideBVH::intersectNode( const WideNode& node, const RayData& data, float tMax, float t_near[WIDTH] )
+{
+#if defined(WIDEBVH_AVX)
+	__m256 t0 = _mm256_setzero_ps();
+	__m256 t1 = _mm256_set1_ps(tMax);
+
+	for (int axis = 0; axis < 3; ++axis) {
+		const __m256 org = _mm256_set1_ps(data.org[axis]);
+		const __m256 inv = _mm256_set1_ps(data.inv_dir[axis]);
+		const __m256 lo = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.box_min[axis]), org), inv);
+		const __m256 hi = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.box_max[axis]), org), inv);
+		t0 = _mm256_max_ps(t0, _mm256_min_ps(lo, hi));
+		t1 = _mm256_min_ps(t1, _mm256_max_ps(lo, hi));
+	}
+
+	_mm256_storeu_ps(t_near, t0);
+	return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & node.valid;
+#elif defined(WIDEBVH_SSE)
+	__m128 t0 = _mm_setzero_ps();
+	__m128 t1 = _mm_set1_ps(tMax);
+
+	for (int axis = 0; axis < 3; ++axis) {
+		const __m128 org = _mm_set1_ps(data.org[axis]);
+		const __m128 inv = _mm_set1_ps(data.inv_dir[axis]);
+		const __m128 lo = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.box_min[axis]), org), inv);
+		const __m128 hi = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.box_max[axis]), org), inv);
+		t0 = _mm_max_ps(t0, _mm_min_ps(lo, hi));
+		t1 = _mm_min_ps(t1, _mm_max_ps(lo, hi));
+	}
+
+	_mm_storeu_ps(t_near, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & node.valid;
+#else
+	int mask = 0;
+	for (int k = 0; k < WIDTH; ++k) {
+		float t0 = 0.0f;
+		float t1 = tMax;
+		for (int axis = 0; axis < 3; ++axis) {
+			const float lo = (node.box_min[axis][k] - data.org[axis]) * data.inv_dir[axis];
+			const float hi = (node.box_max[axis][k] - data.org[axis]) * data.inv_dir[axis];
+			t0 = max(t0, min(lo, hi));
+			t1 = min(t1, max(lo, hi));
+		}
+		t_near[k] = t0;
+		if (t0 <= t1) mask |= 1 << k;
+	}
+	return mask & node.valid;
+#endif
+}
+
+
+void WideBVH::setupRay( const ray& r, RayData& data )
+{
+	// the ray's inverse direction, with infinities (from zero components)
+	// clamped to huge but finite values, which keeps NaNs out of the slab
+	// tests
+	const vec3f org = r.getPosition();
+	const vec3f& inv = r.getInverseDirection();
+	for (int axis = 0; axis < 3; ++axis) {
+		data.org[axis]		= (float)org[axis];
+		data.inv_dir[axis]	= (float)max(-(double)FLT_MAX, min((double)FLT_MAX, inv[axis]));
+	}
+}
+
+
+void WideBVH::traverse( const ray& r, double tMax, AcceleratorVisitor& visitor ) const
+{
+	if (empty()) return;
+
+	RayData data;
+	setupRay(r, data);
+
+	StackEntry root;
+	root.child	= 0;
+	root.count	= 0;
+	root.t		= 0.0f;
+
+	switch (node_format) {
+	case SCENE_NODE_16BIT:
+		traverseFrom(wide_nodes16, root, r, data, tMax, visitor);
+		break;
+	case SCENE_NODE_8BIT:
+		traverseFrom(wide_nodes8, root, r, data, tMax, visitor);
+		break;
+	default:
+		traverseFrom(wide_nodes, root, r, data, tMax, visitor);
+		break;
+	}
+}
+
+
+// The hit children of a node are sorted by entry distance and pushed far
+// first, so the nearest is popped next; like in BVH, an entry is dropped
+// once the visitor has lowered tMax below its distance.
+template<typename NodeType>
+bool WideBVH::traverseFrom( const vector<NodeType>& tree, const StackEntry& start, const ray& r, const RayData& data, double tMax, AcceleratorVisitor& visitor ) const
+{
+	StackEntry	stack[MAX_DEPTH * WIDTH];
+	int			top = 0;
+
+	VisitedSet visited;
+
+	stack[top++] = start;
+
+	while (top > 0) {
+		const StackEntry entry = stack[--top];
+		if (entry.t > tMax) continue;
+
+		// leaf: hand the objects to the visitor
+		if (entry.count > 0) {
+			if (!primitives.empty()) {
+				if (!visitor.visitPrimitives(*primitive_owner, entry.child, entry.count, r, tMax)) return false;
+				continue;
+			}
+			for (int k = entry.child; k < entry.child + entry.count; ++k) {
+				if (!firstVisit(k, visited)) continue;
+				if (!visitor.visit(objects[k], r, tMax)) return false;
+			}
+			continue;
+		}
+
+		const NodeType& node = tree[entry.child];
+		float t_near[WIDTH];
+		int mask = intersectNode(node, data, WideBVH_roundUp(tMax), t_near);
+		if (mask == 0) continue;
+
+		// order the hit children far to near with an insertion sort
+		StackEntry	hits[WIDTH];
+		int			num_hits = 0;
+		for (int k = 0; mask != 0; ++k, mask >>= 1) {
+			if (!(mask & 1)) continue;
+
+			StackEntry hit;
+			hit.child	= node.child[k];
+			hit.count	= node.count[k];
+			hit.t		= t_near[k];
+
+			int j = num_hits++;
+			for (; j > 0 && hits[j - 1].t < hit.t; --j) {
+				hits[j] = hits[j - 1];
+			}
+			hits[j] = hit;
+		}
+
+		for (int k = 0; k < num_hits; ++k) {
+			stack[top++] = hits[k];
+		}
+	}
+
+	return true;
+}
+
+
+void WideBVH::getLeaves( vector< pair<int, int> >& leaves ) const
+{
+	leaves.clear();
+	switch (node_format) {
+	case SCENE_NODE_16BIT:
+		getLeavesOf(wide_nodes16, leaves);
+		break;
+	case SCENE_NODE_8BIT:
+		getLeavesOf(wide_nodes8, leaves);
+		break;
+	default:
+		getLeavesOf(wide_nodes, leaves);
+		break;
+	}
+}
+
+
+template<typename NodeType>
+void WideBVH::getLeavesOf( const vector<NodeType>& tree, vector< pair<int, int> >& leaves )
+{
+	for (size_t n = 0; n < tree.size(); ++n) {
+		for (int k = 0; k < WIDTH; ++k) {
+			if ((tree[n].valid & (1 << k)) && tree[n].count[k] > 0)
+				leaves.push_back(make_pair(tree[n].child[k], tree[n].count[k]));
+		}
+	}
+}
+
+
+void WideBVH::tracePacket( int count, const ray* const* r, isect* const* i, bool local, const Frustum* frustum ) const
+{
+	switch (node_format) {
+	case SCENE_NODE_16BIT:
+		tracePacketFrom(wide_nodes16, count, r, i, local, frustum);
+		break;
+	case SCENE_NODE_8BIT:
+		tracePacketFrom(wide_nodes8, count, r, i, local, frustum);
+		break;
+	default:
+		tracePacketFrom(wide_nodes, count, r, i, local, frustum);
+		break;
+	}
+}
+
+
+template<typename NodeType>
+void WideBVH::tracePacketFrom( const vector<NodeType>& tree, int count, const ray* const* r, isect* const* i, bool local, const Frustum* frustum ) const
+{
+	if (tree.empty()) return;
+
+	struct PacketEntry {
+		StackEntry	entry;
+		uint64_t	rays;			// bit k is set if ray k goes in
+	};
+
+	RayData data[RAY_PACKET_SIZE];
+	for (int k = 0; k < count; ++k) {
+		setupRay(*r[k], data[k]);
+	}
+
+	PacketEntry	stack[MAX_DEPTH * WIDTH];
+	int			top = 0;
+
+	stack[top].entry.child	= 0;
+	stack[top].entry.count	= 0;
+	stack[top].entry.t		= 0.0f;
+	stack[top].rays			= count < 64 ? (((uint64_t)1 << count) - 1) : ~(uint64_t)0;
+	++top;
+
+	const ray*	sub_r[RAY_PACKET_SIZE];
+	isect*		sub_i[RAY_PACKET_SIZE];
+
+	while (top > 0) {
+		const PacketEntry packet = stack[--top];
+		const StackEntry& entry = packet.entry;
+
+		int num_rays = 0;
+		for (uint64_t rays = packet.rays; rays != 0; rays &= rays - 1) {
+			++num_rays;
+		}
+
+		// diverged: finish the subtree one ray at a time
+		if (num_rays < PACKET_MIN_RAYS) {
+			for (int k = 0; k < count; ++k) {
+				if (!(packet.rays & ((uint64_t)1 << k))) continue;
+
+				ClosestHitVisitor visitor(*i[k], local);
+				traverseFrom(tree, entry, *r[k], data[k], i[k]->obj != NULL ? i[k]->t : 1.0e308, visitor);
+			}
+			continue;
+		}
+
+		// leaf: intersect the objects with all the rays at once
+		if (entry.count > 0) {
+			int n = 0;
+			for (int k = 0; k < count; ++k) {
+				if (!(packet.rays & ((uint64_t)1 << k))) continue;
+				sub_r[n] = r[k];
+				sub_i[n] = i[k];
+				++n;
+			}
+
+			intersectLeaf(entry.child, entry.count, n, sub_r, sub_i, local);
+			continue;
+		}
+
+		// interior: a quantized node is decoded once for all the rays
+		WideNode scratch;
+		const WideNode& node = decode(tree[entry.child], scratch);
+
+		// the children outside the frustum cannot be entered by any ray
+		int inside = node.valid;
+		if (frustum != NULL) {
+			for (int j = 0; j < WIDTH; ++j) {
+				if (!(inside & (1 << j))) continue;
+				const BoundingBox bounds = slotBounds(node, j);
+				if (!frustum->overlaps(bounds.min, bounds.max)) inside &= ~(1 << j);
+			}
+			if (inside == 0) continue;
+		}
+
+		// test the rest once per ray, and gather for each child the rays
+		// that enter it and the nearest entry
+		uint64_t	child_rays[WIDTH];
+		float		child_t[WIDTH];
+		for (int j = 0; j < WIDTH; ++j) {
+			child_rays[j]	= 0;
+			child_t[j]		= FLT_MAX;
+		}
+
+		for (int k = 0; k < count; ++k) {
+			if (!(packet.rays & ((uint64_t)1 << k))) continue;
+
+			const double tMax = i[k]->obj != NULL ? i[k]->t : 1.0e308;
+			if (entry.t > tMax) continue;
+
+			float t_near[WIDTH];
+			int mask = intersectNode(node, data[k], WideBVH_roundUp(tMax), t_near) & inside;
+			for (int j = 0; mask != 0; ++j, mask >>= 1) {
+				if (!(mask & 1)) continue;
+				child_rays[j] |= (uint64_t)1 << k;
+				child_t[j] = min(child_t[j], t_near[j]);
+			}
+		}
+
+		// push the children far to near, like the single-ray traversal
+		PacketEntry	hits[WIDTH];
+		int			num_hits = 0;
+		for (int j = 0; j < WIDTH; ++j) {
+			if (child_rays[j] == 0) continue;
+
+			PacketEntry hit;
+			hit.entry.child	= node.child[j];
+			hit.entry.count	= node.count[j];
+			hit.entry.t		= child_t[j];
+			hit.rays		= child_rays[j];
+
+			int m = num_hits++;
+			for (; m > 0 && hits[m - 1].entry.t < hit.entry.t; --m) {
+				hits[m] = hits[m - 1];
+			}
+			hits[m] = hit;
+		}
+
+		for (int j = 0; j < num_hits; ++j) {
+			stack[top++] = hits[j];
+		}
+	}
+}
+
+
+// Static Function Implementation
+// the largest float not above v
+static float WideBVH_roundDown(double v)
+{
+	if (v <= -FLT_MAX) return -FLT_MAX;
+	float f = (float)v;
+	if ((double)f > v) f = nextafterf(f, -FLT_MAX);
+	return f;
+}
+
+
+// the smallest float not below v
+static float WideBVH_roundUp(double v)
+{
+	if (v >= FLT_MAX) return FLT_MAX;
+	float f = (float)v;
+	if ((double)f < v) f = nextafterf(f, FLT_MAX);
+	return f;
+}
+
+
+// The origin of a ray is rounded to float with a relative error of about
+// 6e-8, so the boxes are padded by a comfortable multiple of that at the
+// scale of the tree.
+static float WideBVH_padding(const BoundingBox& root)
+{
+	double scale = 1.0;
+	for (int axis = 0; axis < 3; ++axis) {
+		scale = max(scale, max(fabs(root.min[axis]), fabs(root.max[axis])));
+	}
+	return (float)(scale * 1.0e-6);
+}
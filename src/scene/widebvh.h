@@ -0,0 +1,181 @@
+//
+// widebvh.h
+//
+// A bounding volume hierarchy whose nodes have up to WIDTH children.  The
+// binary SAH tree of BVH is built first and then collapsed, so that every
+// node holds the bounds of its children side by side (one array per axis
+// and side, as floats) and a single SIMD pass tests the ray against all of
+// them.  The tree is about half as deep as the binary one for WIDTH 4 and a
+// third for WIDTH 8, and each node visited is one contiguous block.
+//
+// WIDTH is 8 when the compiler targets AVX, 4 with SSE, and the lanes are
+// tested one by one when neither is available.
+//
+// For very large meshes the nodes can be stored quantized instead: the
+// children's bounds become 8 or 16 bit steps on a grid spanning the node,
+// rounded outwards so that they only ever grow.  The boxes are a little
+// looser, but a node takes about half the memory or less.
+//
+
+#ifndef __WIDEBVH_H__
+#define __WIDEBVH_H__
+
+
+#include <list>
+#include <vector>
+#include <cstdint>
+#include <utility>
+
+#include "scene.h"
+#include "bvh.h"
+
+
+#if defined(__AVX__)
+#define WIDEBVH_AVX
+#define WIDEBVH_WIDTH	8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WIDEBVH_SSE
+#define WIDEBVH_WIDTH	4
+#else
+#define WIDEBVH_WIDTH	4
+#endif
+
+
+class WideBVH: public BVH {
+public:
+	WideBVH( Scene_Node_Format format = SCENE_NODE_FLOAT )
+		: BVH(), wide_nodes(), wide_nodes16(), wide_nodes8(), node_format( format ) {}
+
+	virtual void build( const list<Geometry*>& objs, const BoundingBox& bounds );
+	void buildLocal( const vector<Geometry*>& objs );
+	void buildPrimitives( const vector<BoundingBox>& bounds );
+
+	void clear();
+
+	// Refits the float nodes in place; quantized ones are rebuilt instead.
+	virtual bool refit();
+
+	virtual bool write( vector<char>& out, const vector<Geometry*>& objs ) const;
+	virtual bool read( const char*& data, const char* end, const vector<Geometry*>& objs );
+
+	bool empty() const { return wide_nodes.empty() && wide_nodes16.empty() && wide_nodes8.empty(); }
+
+	// takes effect at the next build
+	void				setNodeFormat( Scene_Node_Format format ) { node_format = format; }
+	Scene_Node_Format	getNodeFormat() const { return node_format; }
+
+	// Front-to-back traversal: the children of a node that the ray enters
+	// before tMax are visited nearest first.
+	virtual void traverse( const ray& r, double tMax, AcceleratorVisitor& visitor ) const;
+
+	// the leaves, as the first and count of the objects or primitives in
+	// each, in no particular order
+	void getLeaves( vector< pair<int, int> >& leaves ) const;
+
+	static const int WIDTH = WIDEBVH_WIDTH;
+
+protected:
+	// Packets go down the tree together: every node is fetched and tested
+	// once for all the rays that reach it, and a leaf's objects get all of
+	// them at once through Geometry::intersectPacket().  A subtree that only
+	// a few rays of the packet enter is finished ray by ray instead.  The
+	// children outside the frustum, if given, are left out before any ray
+	// is tested.
+	virtual void tracePacket( int count, const ray* const* r, isect* const* i, bool local, const Frustum* frustum ) const;
+
+	// The bounds are rounded outwards when converted to float, so a box
+	// never shrinks below the one it was built from.
+	struct WideNode {
+		float	box_min[3][WIDTH];
+		float	box_max[3][WIDTH];
+		int		child[WIDTH];		// leaf: first object, interior: child node
+		int		count[WIDTH];		// number of objects in a leaf, 0 if interior
+		int		valid;				// bit k is set if slot k is in use
+	};
+
+	// A WideNode whose children's bounds are counted in steps of scale from
+	// origin, the low corner of the node's own bounds: slot k spans from
+	// origin + q_min * scale to origin + q_max * scale on each axis.  Q is
+	// the unsigned type of the steps.
+	template<typename Q>
+	struct QuantizedNode {
+		float	origin[3];
+		float	scale[3];
+		Q		q_min[3][WIDTH];
+		Q		q_max[3][WIDTH];
+		int		child[WIDTH];
+		int		count[WIDTH];
+		int		valid;
+	};
+
+	// the ray as the SIMD box test wants it
+	struct RayData {
+		float	org[3];
+		float	inv_dir[3];
+	};
+
+	// a node or leaf waiting on the traversal stack
+	struct StackEntry {
+		int		child;				// as in WideNode
+		int		count;
+		float	t;					// where the ray enters it
+	};
+
+	static void setupRay( const ray& r, RayData& data );
+
+	// the single-ray traversal of the subtree below entry; returns false if
+	// the visitor stopped it
+	template<typename NodeType>
+	bool traverseFrom( const vector<NodeType>& tree, const StackEntry& entry, const ray& r, const RayData& data, double tMax, AcceleratorVisitor& visitor ) const;
+
+	template<typename NodeType>
+	static void getLeavesOf( const vector<NodeType>& tree, vector< pair<int, int> >& leaves );
+
+	// as BVH::checkTree(), for the wide nodes read from a cache file
+	template<typename NodeType>
+	bool checkWideTree( const vector<NodeType>& tree ) const;
+
+	template<typename NodeType>
+	void tracePacketFrom( const vector<NodeType>& tree, int count, const ray* const* r, isect* const* i, bool local, const Frustum* frustum ) const;
+
+	// turn the binary tree in "nodes" into wide_nodes, then drop it
+	void collapse();
+	int collapseNode( int index );
+
+	// as BVH::cost(), over the slots of wide_nodes
+	double cost() const;
+
+	// the bounds of slot k of a node, as stored
+	static BoundingBox slotBounds( const WideNode& node, int k );
+
+	// a node with its bounds as floats: the node itself, or a quantized one
+	// decoded into scratch
+	static const WideNode& decode( const WideNode& node, WideNode& /*scratch*/ ) { return node; }
+
+	template<typename Q>
+	static const WideNode& decode( const QuantizedNode<Q>& node, WideNode& scratch );
+
+	// turn wide_nodes into quantized nodes, then drop them
+	template<typename Q>
+	void quantize( vector< QuantizedNode<Q> >& out );
+
+	// mask of the slots whose boxes the ray enters between 0 and tMax, with
+	// their entry distances in t_near
+	static int intersectNode( const WideNode& node, const RayData& data, float tMax, float t_near[WIDTH] );
+
+	template<typename Q>
+	static int intersectNode( const QuantizedNode<Q>& node, const RayData& data, float tMax, float t_near[WIDTH] );
+
+	// only one of these is in use, as set by node_format
+	vector<WideNode>					wide_nodes;
+	vector< QuantizedNode<uint16_t> >	wide_nodes16;
+	vector< QuantizedNode<uint8_t> >	wide_nodes8;
+	Scene_Node_Format					node_format;
+
+	// added to every box in the float conversion, so that the rounding of
+	// the ray origin cannot make a ray miss a box it touches
+	float								pad;
+};
+
+
+#endif // __WIDEBVH_H__